@@ -1,30 +1,184 @@
 // Oneditor文本编辑器
-// 构建：gcc oneditor.c -o oneditor.exe
+// 构建：gcc oneditor.c -o oneditor.exe（Windows）
+//       gcc -O2 -pthread oneditor.c -o oneditor（Linux 等 POSIX 系统）
+// 宽度表：python3 tools/gen_wcwidth.py > wcwidth_table.h（升级 Unicode 版本时重新生成）
 #include <stdio.h>         // 标准输入输出
 #include <stdlib.h>        // 标准库
 #include <string.h>        // 字符串处理
-#include <windows.h>       // Windows API
-#include <conio.h>         // 控制台输入
 #include <wchar.h>         // 宽字符处理
 #include <locale.h>        // 区域设置
 #include <ctype.h>         // 字符处理
+#include <time.h>          // 时钟
+#ifdef _WIN32
+#include <windows.h>       // Windows API
+#include <conio.h>         // 控制台输入
+#include <io.h>            // _commit
+#else
+#include <unistd.h>        // read/write
+#include <fcntl.h>         // open
+#include <poll.h>          // 按键超时等待
+#include <termios.h>       // 终端原始模式
+#include <pthread.h>       // 线程
+#include <sys/ioctl.h>     // 窗口尺寸
+#include <sys/mman.h>      // 文件映射
+#include <sys/stat.h>      // 文件大小
+#include <iconv.h>         // GBK 转码
+#include <errno.h>         // iconv 错误原因
+#ifdef __linux__
+#include <sys/inotify.h>   // :follow 的文件变化通知
+#endif
+#endif
+#if defined(__SSE2__)||defined(__x86_64__)
+#include <immintrin.h>     // SSE2/AVX2 搜索内核
+#endif
+#include "wcwidth_table.h" // 码点宽度/字形簇属性表（tools/gen_wcwidth.py 生成）
 
-#define MAX_LINES 1000                // 最大文本行数
-#define MAX_COLS  512                 // 每行最大字符数
+#define MAX_COLS  512                 // 命令行最大字符数
 #define MAX_ROWS 100                  // 屏幕最大显示行数
 #define MAX_COLS_SCREEN 256           // 屏幕最大显示列数
-#define UNDO_STACK 100                // 撤销栈深度
+#define UNDO_MEM_LIMIT (64<<20)       // 撤销日志内存上限（字节）
 #define CMD_HISTORY_MAX 100           // 命令历史条数
+#define LINE_CACHE 64                 // 行内容缓存槽数
+#define LINE_CKPT 32                  // 行内每隔多少个字符记录一个列→字节检查点
+#define NL_SCAN_PAR_MIN (4<<20)       // 超过此大小时并行扫描换行
+#define NL_SCAN_MAX_THREADS 16        // 并行扫描最大线程数
+#define CELL_BYTES 16                 // 单元格内一个字形簇最多保存的字节数
+#define SEARCH_PAT_MAX 128            // 搜索串最大字节数（与 last_pat 一致）
+#define SEARCH_BLOCK (1<<20)          // 反向查找时每次向前扫描的字节数
+#define SEARCH_PAR_MIN (4<<20)        // 超过此大小时并行建立匹配索引
+#define SEARCH_MAX_THREADS 16         // 建立匹配索引的最大线程数
+#define SUBST_GAP 4096                // 替换时相距不到此字节数的匹配合为一次编辑
+#define RE_SYM_EOL 256                // 正则DFA的行尾虚拟输入
+#define RE_REP_MAX 255                // 正则 {m,n} 次数上限
+#define RE_MAX_NODES 65536            // 正则NFA节点上限
+#define DFA_MAX_STATES 2048           // 惰性DFA缓存状态数上限，超出时清空重建
+#define INPUT_BATCH_NS 50000000ULL    // 一批输入最长处理时间，超过后先重绘一次
+#define PASTE_TIMEOUT_MS 1000         // 括号粘贴中途等待输入的最长时间
+#define CMD_COUNT_MAX 100000000      // 数字前缀上限
+#define POOL_SLAB (64<<10)            // 内存池每次向系统申请的块大小
+#define SWAP_SYNC_NS 2000000000ULL    // 交换日志两次落盘（fsync）的最短间隔
+#define SWAP_BUF_MAX (1<<20)          // 交换日志缓冲超过此大小时立即写出
+#define SAVE_BUF (1<<20)              // 保存时的写缓冲大小
+#define SAVE_ASYNC_MIN (8<<20)        // 超过此大小的文件保存时在后台落盘
+#define LOAD_ASYNC_MIN (8<<20)        // 超过此大小的文件在后台边扫描边显示
+#define LOAD_CHUNK (1<<20)            // 后台加载每次发布的字节数
+#define NL_SPARSE_STEP 256            // 只读查看时换行索引每隔多少个换行记一个检查点
+#define FOLLOW_POLL_MS 200            // 没有文件变化通知时 :follow 检查文件大小的间隔
+#define FOLLOW_MIN_MS 50              // :follow 两次读入新内容的最短间隔
+#define ENC_SAMPLE (64<<10)           // 判断编码时每个抽样窗口的字节数
+#define ENC_WINDOWS 16                // 大文件判断编码时均匀抽样的窗口数（更小的文件整个检查）
+#define TEXT_WRITE_SEG (64<<10)       // 按原编码保存时每段转换的字节数
+#ifdef _WIN32
+#define DEFAULT_CRLF 1                // 新建文件的换行：Windows 上为 \r\n
+#else
+#define DEFAULT_CRLF 0
+#endif
+#define HL_SPAN_MAX 8                 // 高亮颜色转义序列的最大字节数
+#define PERF_SUB_BITS 4               // 延迟直方图每个2的幂区间再分 2^PERF_SUB_BITS 格
+#define PERF_SUB (1<<PERF_SUB_BITS)
+#define PERF_BUCKETS (37*PERF_SUB)    // 直方图桶数：最大约 2^40 纳秒（约18分钟）
+#define POOL_CLASSES 8                // 内存池尺寸类数：16、32……2048 字节，更大的单独分配
+
+// 文件内容的编码（文档内部一律为UTF-8）
+enum { ENC_UTF8, ENC_GBK, ENC_UTF16LE, ENC_UTF16BE };
+
+// 高亮类别：屏幕单元格的属性，0 为不着色
+enum { HL_NONE, HL_KEYWORD, HL_TYPE, HL_STRING, HL_NUMBER, HL_COMMENT, HL_PREPROC, HL_KEY,
+       HL_ERROR, HL_WARN, HL_INFO, HL_DEBUG, HL_COUNT };
+
+// 特殊按键：普通字符以Unicode码点表示，特殊键取码点范围之外的值
+enum { KEY_UP=0x110000, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_PASTE };
+
+// 屏幕单元格：一个字形簇的UTF-8字节、显示宽度与高亮类别，宽字符的第二列 width=0
+typedef struct {
+    char ch[CELL_BYTES];
+    unsigned char len, width, attr;
+} ScreenCell;
+
+// 终端后端：输入事件、窗口尺寸、单元格输出与光标定位
+typedef struct {
+    const char *name;
+    void (*init)(void);
+    void (*shutdown)(void);
+    void (*set_raw)(int raw);                  // 原始输入/行输入模式
+    int  (*read_key)(void);                    // 阻塞读取一个按键
+    int  (*key_pending)(int ms);               // ms 毫秒内是否有待读的输入（0 为不等待，-1 为一直等待）
+    void (*get_size)(int *rows, int *cols);
+    void (*begin_frame)(int full);             // full 表示整屏重绘
+    void (*put_span)(int row, int col, const ScreenCell *c, int n); // 输出一段单元格
+    void (*end_frame)(int x, int y, int dirty);// 定位光标并写出本帧
+    void (*print)(const char *s);              // 直接输出提示信息
+} TermBackend;
 
 // 编辑器模式（普通、插入）
 typedef enum { MODE_NORMAL, MODE_INSERT } EditorMode;
 
-// 撤销状态结构体：快照一份文本内容与光标
+// 片表所引用的缓冲：原始文件内容 / 只追加的添加缓冲
+enum { BUF_ORIG, BUF_ADD };
+
+// 文本缓冲：内容与其中换行符的位置索引（升序）
+typedef struct {
+    char *data;
+    size_t len, cap;
+    size_t *nl;
+    size_t nl_count, nl_cap;
+    size_t nl_step;          // 非0时为稀疏索引：nl[k] 只记第 (k+1)*nl_step 个换行，其余现数
+    int mapped;              // data 是否为文件映射
+    char *pinned;            // 后台快照仍在读取的数据块，扩容时不能释放
+} TextBuf;
+
+// 内存池中向系统申请的块（大块切分后使用，或超过最大尺寸类的单独分配），双向链接以便整体释放
+typedef struct PoolChunk {
+    struct PoolChunk *prev, *next;
+    size_t size, pad;        // 数据字节数；pad 使数据按 16 字节对齐
+} PoolChunk;
+
+// 内存池：按尺寸类从大块中切分，释放的块挂回所属尺寸类的空闲链表；可整池一次释放
+typedef struct {
+    PoolChunk *slabs, *bigs;         // 大块 / 单独分配
+    void *free_list[POOL_CLASSES];   // 各尺寸类空闲块
+    char *cur; size_t cur_left;      // 当前大块中尚未切分的部分
+    size_t used, reserved;           // 分配出去的字节（按尺寸类取整）/ 向系统申请的字节
+    size_t big; int nslabs;          // 其中单独分配的字节 / 大块个数
+} Pool;
+
+// 片段节点：按文档顺序组成隐式键树堆，子树维护总字节数与总换行数。
+// 节点可被当前文档与后台保存的快照共享，被共享（引用数>1）的节点修改前先复制
+typedef struct Piece {
+    struct Piece *l, *r;     // 左右子树
+    unsigned pri:31, buf:1;  // 堆优先级，所属缓冲
+    int ref;                 // 引用数（父节点或树根）
+    size_t start, len, lf;   // 缓冲内起点、长度、换行数
+    size_t sum_len, sum_lf;  // 子树总长度、总换行数
+} Piece;
+
+// 列→字节检查点
+typedef struct { int pos, col; } ColCkpt;
+
+// 行缓存槽：按行号直接映射，缓存行内容、显示宽度与稀疏的列→字节检查点；只有被编辑的行失效
+typedef struct {
+    int valid, line;
+    char *text;
+    size_t cap;
+    int len, width;          // 字节数、显示宽度
+    ColCkpt *ck;             // 每 LINE_CKPT 个字符一个检查点，ck[0] 为行首
+    int nck, ck_cap;
+} LineSlot;
+
+// 撤销操作：一次插入或删除的偏移与字节
 typedef struct {
-    char lines[MAX_LINES][MAX_COLS];
-    int line_count;
-    int cx, cy;
-} UndoState;
+    int del;                 // 1删除 0插入
+    size_t off, len;         // 文档偏移、字节数
+    char *text;              // 插入/删除的内容
+} UndoOp;
+
+// 撤销组：连续输入合并为一组，按时间顺序双向链接
+typedef struct UndoGroup {
+    struct UndoGroup *prev, *next;
+    UndoOp *ops;
+    int nops, cap;
+    int cx0, cy0, cx1, cy1;  // 编辑前/后光标
+} UndoGroup;
 
 // 命令处理函数指针类型
 typedef void (*CmdHandler)(int);
@@ -36,12 +190,12 @@ typedef struct {
 } CmdEntry;
 
 // 常用命令处理函数
-#define NORM_CMD_NUM 18
+#define NORM_CMD_NUM 19
 // 命令处理函数声明
 void norm_insert(int), norm_insert_head(int), norm_insert_end(int);
 void norm_left(int), norm_right(int), norm_up(int), norm_down(int);
 void norm_line_head(int), norm_line_end(int), norm_del_char(int);
-void undo_handler(int), norm_cmdmode(int), norm_search_next(int), norm_search_prev(int);
+void undo_handler(int), redo_handler(int), norm_cmdmode(int), norm_search_next(int), norm_search_prev(int);
 void norm_combo_handler(int);
 // 命令表
 CmdEntry normal_cmds[NORM_CMD_NUM] = {
@@ -56,6 +210,7 @@ CmdEntry normal_cmds[NORM_CMD_NUM] = {
     {'9', norm_line_end, "行尾"},
     {'x', norm_del_char, "删字符"},
     {'u', undo_handler, "撤销"},
+    {18, redo_handler, "重做"},
     {':', norm_cmdmode, "命令模式"},
     {'n', norm_search_next, "下一个"},
     {'N', norm_search_prev, "上一个"},
@@ -71,16 +226,42 @@ int cmd_history_count = 0;
 int cmd_history_pos = -1;
 
 // 编辑器主缓冲/状态
-char lines[MAX_LINES][MAX_COLS]; // 编辑区
+TextBuf orig_buf, add_buf;          // 原始缓冲、添加缓冲
+Piece *pt_root = NULL;              // 片段树根
+Pool piece_pool, undo_pool;         // 片段节点 / 撤销记录所用的内存池
+LineSlot line_cache[LINE_CACHE];    // 行缓存
+unsigned edit_gen = 1;              // 编辑计数
+unsigned saved_gen = 0;             // 磁盘上的文件对应的 edit_gen
 int line_count = 1, cx = 0, cy = 0; // 当前行数，光标
 int insert_mode = 0;                // 是否插入模式
+int view_mode = 0;                  // 以 -R 启动：只读查看，不能编辑与保存
+int doc_enc = ENC_UTF8, doc_bom = 0; // 文件的编码、是否带 BOM（保存时按此写回）
+int doc_crlf = DEFAULT_CRLF;        // 文件的换行是否为 \r\n（保存时按此写回）
+int cmd_count = 0;                  // 正常模式命令的数字前缀（0表示未输入）
 char filename[256] = "";            // 当前文件名
 char last_pat[128] = "";            // 最近搜索内容
 int last_found = -1, show_lineno = 0; // 最近查找行，是否显示行号
+int *match_lines = NULL;            // 匹配索引：含 match_pat 的行号（升序）
+int match_count = 0, match_cap = 0, match_valid = 0; // 索引条数/容量，索引是否与文档一致
+char match_pat[128] = "";           // 索引对应的搜索内容
+int last_regex = 0, match_regex = 0; // 最近搜索/索引是否为正则表达式
 int scroll = 0, hscroll = 0;          // 滚动行/列
-char screenbuf[MAX_ROWS][MAX_COLS_SCREEN]; // 屏幕缓冲区
-UndoState undo_stack[UNDO_STACK]; // 撤销栈
-int undo_top = 0, undo_cur = 0;   // 撤销指针
+ScreenCell screenbuf[MAX_ROWS][MAX_COLS_SCREEN]; // 屏幕缓冲区（本帧）
+ScreenCell prevbuf[MAX_ROWS][MAX_COLS_SCREEN];   // 上一帧已输出的内容
+int prev_rows = 0, prev_cols = 0, screen_valid = 0; // 上一帧尺寸，上一帧是否与控制台一致
+int cur_x = 0, cur_y = 0, prev_cur_x = -1, prev_cur_y = -1; // 本帧/上一帧光标位置
+TermBackend term;                   // 当前终端后端
+char *outbuf = NULL;                // 一帧的输出缓冲
+size_t out_len = 0, out_cap = 0, out_pre = 0; // 已用/容量/帧首隐藏光标前缀长度
+char *paste_buf = NULL;             // 最近一次粘贴的内容（UTF-8），随 KEY_PASTE 交付
+size_t paste_len = 0, paste_cap = 0;
+UndoGroup *undo_first = NULL, *undo_last = NULL; // 撤销日志首尾
+UndoGroup *undo_pos = NULL;       // 最近生效的组，其后为可重做的组
+int undo_open = 0;                // undo_pos 是否仍在合并输入
+int undo_replaying = 0;           // 正在撤销/重做，不记录日志
+int undo_hold = 0;                // 正在处理一批输入，推迟结束撤销组
+int undo_seal_pending = 0;        // 本批输入中有过编辑边界，批末结束撤销组
+size_t undo_bytes = 0;            // 撤销日志占用字节
 EditorMode mode = MODE_NORMAL;    // 当前编辑器模式
 
 // 帮助信息
@@ -88,8 +269,8 @@ const char *normal_help =
 "可用命令：\n"
 "i：插入模式  :：命令模式\n"
 "h：左  j：上  k：下  l：右  0：行首  9：行尾\n"
-"gg/GG：首/末行  u：撤销  x：删字符  dd：删行\n"
-"oo：下方插入新行\n";
+"gg/GG：首/末行  u：撤销  Ctrl-R：重做  x：删字符  dd：删行\n"
+"oo：下方插入新行  数字前缀：5dd 删5行  5oo 插5行  5gg 到第5行\n";
 
 const char *insert_help =
 "可用命令：\n"
@@ -104,36 +285,240 @@ const char *cmd_help =
 ":r 文件名 打开文件\n"
 ":set nu 显行号 :set nonu 隐藏行号\n"
 ":go 行号 跳转到指定行\n"
-":!命令 外部命令 :f 内容 搜索 n/N 查找\n";
+":!命令 外部命令 :f 内容 搜索 n/N 查找\n"
+":fr 正则 按正则表达式搜索\n"
+":set autosave=N 每N秒自动保存（0关闭）\n"
+":set enc=utf-8|gbk|utf-16le|utf-16be 保存编码 :set ff=unix|dos 换行\n"
+":set syntax=c|json|python|sh|log|off 语法高亮\n"
+":follow 跟随文件新增内容 :nofollow 停止\n"
+":[%|行,行]s/查找/替换/[gi] 替换（& 为匹配内容）\n"
+":mem 查看内存占用\n"
+":perf 按键延迟统计（p50/p90/p99/max） :perf reset 清零\n";
 
-// 设置控制台为UTF-8模式
-void set_console_utf8() {
-    SetConsoleOutputCP(CP_UTF8);
-    SetConsoleCP(CP_UTF8);
-    setlocale(LC_ALL, "");
+// ------------- 平台层 -------------
+// 终端、文件映射与线程在此按平台实现：Windows 走控制台 API（支持 VT 时整帧走 ANSI 序列），
+// 其它平台走 termios + ANSI；编辑器其余部分只通过 term 与下列函数访问平台。
+
+// UTF-8编码一个码点，返回字节数
+int utf8_encode(int cp, char *out) {
+    if(cp<0x80) { out[0]=(char)cp; return 1; }
+    if(cp<0x800) { out[0]=(char)(0xC0|cp>>6); out[1]=(char)(0x80|(cp&0x3F)); return 2; }
+    if(cp<0x10000) { out[0]=(char)(0xE0|cp>>12); out[1]=(char)(0x80|((cp>>6)&0x3F)); out[2]=(char)(0x80|(cp&0x3F)); return 3; }
+    out[0]=(char)(0xF0|cp>>18); out[1]=(char)(0x80|((cp>>12)&0x3F)); out[2]=(char)(0x80|((cp>>6)&0x3F)); out[3]=(char)(0x80|(cp&0x3F));
+    return 4;
+}
+// 解码s处的一个UTF-8字符，返回消耗的字节数（非法字节按单字节处理）
+int utf8_decode(const char *s, int *cp) {
+    unsigned char c=(unsigned char)s[0];
+    int n=c<0x80?1:(c&0xE0)==0xC0?2:(c&0xF0)==0xE0?3:(c&0xF8)==0xF0?4:1;
+    if(n==1) { *cp=c; return 1; }
+    int v=c&(0x3F>>(n-1));
+    for(int i=1;i<n;i++) {
+        if(((unsigned char)s[i]&0xC0)!=0x80) { *cp=c; return 1; }
+        v=(v<<6)|((unsigned char)s[i]&0x3F);
+    }
+    *cp=v; return n;
 }
 
-// 设置控制台为原始输入模式
-void set_console_raw() {
-    HANDLE h=GetStdHandle(STD_INPUT_HANDLE);
-    DWORD m;
-    GetConsoleMode(h,&m);
-    m&=~(ENABLE_ECHO_INPUT|ENABLE_LINE_INPUT);
-    SetConsoleMode(h,m);
+// 追加到粘贴缓冲
+void paste_add(const char *s, size_t n) {
+    if(paste_len+n>paste_cap) {
+        while(paste_len+n>paste_cap) paste_cap=paste_cap?paste_cap*2:4096;
+        paste_buf=(char*)realloc(paste_buf,paste_cap);
+    }
+    memcpy(paste_buf+paste_len,s,n); paste_len+=n;
+}
+// 读取括号粘贴的内容直到结束序列 ESC[201~（或输入中断），存入粘贴缓冲
+int read_paste(int (*getbyte)(int)) {
+    static const char end[]="\x1b[201~";
+    int k=0;
+    paste_len=0;
+    while(1) {
+        int c=getbyte(PASTE_TIMEOUT_MS);
+        if(c<0) break;
+        if(c==(unsigned char)end[k]) { if(++k==6) break; continue; }
+        if(k) { paste_add(end,k); k=0; if(c==27) { k=1; continue; } }
+        char b=(char)c; paste_add(&b,1);
+    }
+    return KEY_PASTE;
+}
+// 解码s处最多n字节中的一个UTF-8字符，返回消耗的字节数（n不足或非法时按单字节处理）
+int utf8_decode_n(const char *s, size_t n, int *cp) {
+    unsigned char c=(unsigned char)s[0];
+    int k=c<0x80?1:(c&0xE0)==0xC0?2:(c&0xF0)==0xE0?3:(c&0xF8)==0xF0?4:1;
+    if((size_t)k>n) { *cp=c; return 1; }
+    return utf8_decode(s,cp);
+}
+// s[0,n)去掉末尾不完整的UTF-8字符后的长度
+size_t utf8_complete(const char *s, size_t n) {
+    for(size_t k=1;k<=3&&k<=n;k++) {
+        unsigned char c=(unsigned char)s[n-k];
+        if((c&0xC0)==0x80) continue;
+        int need=c<0x80?1:(c&0xE0)==0xC0?2:(c&0xF0)==0xE0?3:(c&0xF8)==0xF0?4:1;
+        return (size_t)need>k?n-k:n;
+    }
+    return n;
+}
+// 从字节源解析一个按键：解码UTF-8，方向键转义序列转为 KEY_*，括号粘贴整段作为 KEY_PASTE，单独的ESC在短暂等待后返回27；
+// getbyte(timeout_ms) 超时或无输入时返回-1，unget 退回一个预读字节；字节源结束时返回-1
+int parse_key(int (*getbyte)(int), void (*unget)(int)) {
+    while(1) {
+        int c=getbyte(-1);
+        if(c<0) return -1;
+        if(c==27) {
+            int c1=getbyte(30);
+            if(c1<0) return 27;
+            if(c1!='['&&c1!='O') { unget(c1); return 27; }
+            int c2=getbyte(30), num=0;
+            while(c2>='0'&&c2<='9') { num=num*10+c2-'0'; c2=getbyte(30); }
+            if(c2=='~'&&num==200) return read_paste(getbyte);
+            if(c2=='A') return KEY_UP;
+            if(c2=='B') return KEY_DOWN;
+            if(c2=='D') return KEY_LEFT;
+            if(c2=='C') return KEY_RIGHT;
+            continue;
+        }
+        if(c>=0x80) {
+            char b[4]={(char)c}; int n=(c&0xE0)==0xC0?2:(c&0xF0)==0xE0?3:(c&0xF8)==0xF0?4:1;
+            for(int i=1;i<n;i++) { int d=getbyte(30); if(d<0) break; b[i]=(char)d; }
+            int cp; utf8_decode(b,&cp);
+            return cp;
+        }
+        return c;
+    }
 }
 
-// 设置控制台为普通输入模式
-void set_console_normal() {
+// 追加到输出缓冲
+void out_append(const char *s, size_t n) {
+    if(out_len+n>out_cap) {
+        while(out_len+n>out_cap) out_cap=out_cap?out_cap*2:8192;
+        outbuf=(char*)realloc(outbuf,out_cap);
+    }
+    memcpy(outbuf+out_len,s,n); out_len+=n;
+}
+void term_write(const char *s, size_t n);
+// 各高亮类别的 SGR 颜色序列
+const char *hl_sgr[HL_COUNT] = { "\x1b[0m", "\x1b[33m", "\x1b[32m", "\x1b[35m", "\x1b[31m", "\x1b[36m",
+    "\x1b[95m", "\x1b[94m", "\x1b[1;31m", "\x1b[1;33m", "\x1b[32m", "\x1b[90m" };
+// 把一段单元格编码到dst（宽字符第二格不输出），sgr 为真时在类别变化处插入颜色序列并在末尾复位；返回字节数。
+// dst 至少 n*(CELL_BYTES+HL_SPAN_MAX) 字节
+size_t row_cells(const ScreenCell *c, int n, char *dst, int sgr) {
+    size_t len=0; int attr=HL_NONE;
+    for(int j=0;j<n;j++) {
+        if(!c[j].width) continue;
+        if(sgr&&c[j].attr!=attr) { attr=c[j].attr; size_t k=strlen(hl_sgr[attr]); memcpy(dst+len,hl_sgr[attr],k); len+=k; }
+        memcpy(dst+len,c[j].ch,c[j].len); len+=c[j].len;
+    }
+    if(attr) { memcpy(dst+len,hl_sgr[0],4); len+=4; }
+    return len;
+}
+// ANSI 帧：先隐藏光标，整屏重绘时清屏
+void ansi_begin_frame(int full) {
+    out_len=0;
+    out_append(full?"\x1b[?25l\x1b[2J":"\x1b[?25l",full?10:6);
+    out_pre=out_len;
+}
+// ANSI 帧：定位后输出一段单元格
+void ansi_put_span(int row, int col, const ScreenCell *c, int n) {
+    char esc[32], span[MAX_COLS_SCREEN*(CELL_BYTES+HL_SPAN_MAX)];
+    out_append(esc,snprintf(esc,sizeof(esc),"\x1b[%d;%dH",row+1,col+1));
+    out_append(span,row_cells(c,n,span,1));
+}
+// ANSI 帧：定位光标后一次写出；无内容变化时跳过隐藏光标前缀，只输出定位
+void ansi_end_frame(int x, int y, int dirty) {
+    char esc[32];
+    out_append(esc,snprintf(esc,sizeof(esc),dirty?"\x1b[%d;%dH\x1b[?25h":"\x1b[%d;%dH",y+1,x+1));
+    term_write(outbuf+(dirty?0:out_pre),out_len-(dirty?0:out_pre));
+}
+
+// 线程入口参数
+typedef struct { void (*fn)(void*); void *arg; } ThreadStart;
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+int vt_enabled = 0;                 // 控制台是否支持VT转义序列
+
+// 写出到控制台
+void term_write(const char *s, size_t n) {
+    DWORD written;
+    WriteConsoleA(GetStdHandle(STD_OUTPUT_HANDLE),s,(DWORD)n,&written,NULL);
+}
+// 设置控制台为原始/普通输入模式
+void win32_set_raw(int raw) {
     HANDLE h=GetStdHandle(STD_INPUT_HANDLE);
     DWORD m;
     GetConsoleMode(h,&m);
-    m|=(ENABLE_ECHO_INPUT|ENABLE_LINE_INPUT);
+    if(raw) m&=~(ENABLE_ECHO_INPUT|ENABLE_LINE_INPUT); else m|=(ENABLE_ECHO_INPUT|ENABLE_LINE_INPUT);
     SetConsoleMode(h,m);
 }
-
+int win32_pending_key = -1;          // 粘贴检测时多读出的按键
+// 读取一个按键：合并代理对，方向键转为 KEY_*
+int win32_read_one() {
+    while(1) {
+        int ch=_getwch();
+        if(ch==0||ch==224) {
+            int arrow=_getwch();
+            if(arrow==72) return KEY_UP;
+            if(arrow==80) return KEY_DOWN;
+            if(arrow==75) return KEY_LEFT;
+            if(arrow==77) return KEY_RIGHT;
+            continue;
+        }
+        if(ch>=0xD800&&ch<=0xDBFF) { int lo=_getwch(); return 0x10000+((ch-0xD800)<<10)+(lo-0xDC00); }
+        return ch;
+    }
+}
+// 读取按键：控制台没有括号粘贴，文本字符之后已有输入到达时视为粘贴，一次取出其后连续的文本字符作为 KEY_PASTE
+int win32_read_key() {
+    if(win32_pending_key>=0) { int k=win32_pending_key; win32_pending_key=-1; return k; }
+    int k=win32_read_one();
+    if((k<0x20&&k!='\t')||k>=KEY_UP||!_kbhit()) return k;
+    char u[4];
+    paste_len=0; paste_add(u,utf8_encode(k,u));
+    while(_kbhit()) {
+        int c=win32_read_one();
+        if(c>=KEY_UP||(c<0x20&&c!='\t'&&c!='\r'&&c!='\n')) { win32_pending_key=c; break; }
+        paste_add(u,utf8_encode(c,u));
+    }
+    return KEY_PASTE;
+}
+// 是否有待读按键
+int win32_key_pending(int ms) {
+    if(win32_pending_key>=0||_kbhit()) return 1;
+    if(ms&&WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE),ms<0?INFINITE:(DWORD)ms)==WAIT_OBJECT_0) return _kbhit();
+    return 0;
+}
+// 控制台窗口行列数
+void win32_get_size(int *rows, int *cols) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE),&csbi);
+    *rows=csbi.srWindow.Bottom-csbi.srWindow.Top+1;
+    *cols=csbi.srWindow.Right-csbi.srWindow.Left+1;
+}
+// 各高亮类别的控制台文字属性
+const WORD hl_win_attr[HL_COUNT] = {
+    FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_BLUE, FOREGROUND_RED|FOREGROUND_GREEN, FOREGROUND_GREEN,
+    FOREGROUND_RED|FOREGROUND_BLUE, FOREGROUND_RED, FOREGROUND_GREEN|FOREGROUND_BLUE,
+    FOREGROUND_RED|FOREGROUND_BLUE|FOREGROUND_INTENSITY, FOREGROUND_BLUE|FOREGROUND_INTENSITY,
+    FOREGROUND_RED|FOREGROUND_INTENSITY, FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_INTENSITY, FOREGROUND_GREEN,
+    FOREGROUND_INTENSITY };
+// 无VT时每段单元格的字符与属性直接写入控制台缓冲
+void win32_begin_frame(int full) {}
+void win32_put_span(int row, int col, const ScreenCell *c, int n) {
+    char s[MAX_COLS_SCREEN*CELL_BYTES]; wchar_t wrow[MAX_COLS_SCREEN*CELL_BYTES]; WORD attr[MAX_COLS_SCREEN]; DWORD written;
+    int len=(int)row_cells(c,n,s,0), wn=MultiByteToWideChar(CP_UTF8,0,s,len,wrow,MAX_COLS_SCREEN*CELL_BYTES);
+    for(int j=0;j<n;j++) attr[j]=hl_win_attr[c[j].width?c[j].attr:j?c[j-1].attr:HL_NONE];
+    COORD pos={(short)col,(short)row};
+    HANDLE h=GetStdHandle(STD_OUTPUT_HANDLE);
+    WriteConsoleOutputCharacterW(h,wrow,wn,pos,&written);
+    WriteConsoleOutputAttribute(h,attr,n,pos,&written);
+}
+void win32_end_frame(int x, int y, int dirty) {
+    COORD pos={(short)x,(short)y};
+    SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE),pos);
+}
 // 控制台输出utf8字符串
-void print_utf8(const char *utf8str) {
-    if (!utf8str) return;
+void win32_print(const char *utf8str) {
     int wlen = MultiByteToWideChar(CP_UTF8, 0, utf8str, -1, NULL, 0);
     if (wlen <= 0) return;
     wchar_t *wbuf = (wchar_t*)malloc(wlen * sizeof(wchar_t));
@@ -143,6 +528,358 @@ void print_utf8(const char *utf8str) {
     WriteConsoleW(GetStdHandle(STD_OUTPUT_HANDLE), wbuf, wcslen(wbuf), &written, NULL);
     free(wbuf);
 }
+// 设置控制台为UTF-8模式，并尽量开启VT转义序列以便整帧一次写出
+void win32_init() {
+    SetConsoleOutputCP(CP_UTF8);
+    SetConsoleCP(CP_UTF8);
+    setlocale(LC_ALL, "");
+    HANDLE hOut=GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD m;
+    if(GetConsoleMode(hOut,&m)&&SetConsoleMode(hOut,m|ENABLE_VIRTUAL_TERMINAL_PROCESSING)) {
+        vt_enabled=1;
+        term.begin_frame=ansi_begin_frame; term.put_span=ansi_put_span; term.end_frame=ansi_end_frame;
+    }
+    win32_set_raw(1);
+}
+void win32_shutdown() { win32_set_raw(0); }
+TermBackend platform_term={"win32",win32_init,win32_shutdown,win32_set_raw,win32_read_key,win32_key_pending,win32_get_size,
+    win32_begin_frame,win32_put_span,win32_end_frame,win32_print};
+
+// utf8转gbk（windows下中文路径支持）
+int utf8_to_gbk(const char *utf8, char *gbk, int gbk_size) {
+    int wlen = MultiByteToWideChar(CP_UTF8, 0, utf8, -1, NULL, 0);
+    if (wlen <= 0) return 0;
+    wchar_t *wbuf = (wchar_t*)malloc(wlen * sizeof(wchar_t));
+    if (!wbuf) return 0;
+    MultiByteToWideChar(CP_UTF8, 0, utf8, -1, wbuf, wlen);
+    int glen = WideCharToMultiByte(936, 0, wbuf, -1, gbk, gbk_size, NULL, NULL);
+    free(wbuf);
+    return glen;
+}
+// 支持utf8文件名的fopen
+FILE *fopen_utf8(const char *fname, const char *mode) {
+    char gbk_fname[512];
+    utf8_to_gbk(fname, gbk_fname, sizeof(gbk_fname));
+    return fopen(gbk_fname, mode);
+}
+// 只读映射整个文件；成功返回1，空文件时*data为NULL
+int file_map(const char *fname, char **data, size_t *size) {
+    wchar_t wname[1024];
+    if(!MultiByteToWideChar(CP_UTF8,0,fname,-1,wname,1024)) return 0;
+    HANDLE f=CreateFileW(wname,GENERIC_READ,FILE_SHARE_READ|FILE_SHARE_WRITE,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+    if(f==INVALID_HANDLE_VALUE) return 0;
+    LARGE_INTEGER sz;
+    if(!GetFileSizeEx(f,&sz)) { CloseHandle(f); return 0; }
+    *data=NULL; *size=(size_t)sz.QuadPart;
+    if(*size) {
+        HANDLE m=CreateFileMappingW(f,NULL,PAGE_READONLY,0,0,NULL);
+        if(m) { *data=(char*)MapViewOfFile(m,FILE_MAP_READ,0,0,0); CloseHandle(m); }
+    }
+    CloseHandle(f);
+    return *size==0||*data!=NULL;
+}
+// 解除文件映射
+void file_unmap(char *data, size_t size) { UnmapViewOfFile(data); }
+// 映射中已读过的页移出工作集（内容不变，再访问时从文件读回）
+void file_drop(const char *data, size_t size) { VirtualUnlock((void*)data,size); }
+// 文件当前大小；成功返回1
+int file_size_of(const char *fname, size_t *size) {
+    wchar_t wname[1024]; WIN32_FILE_ATTRIBUTE_DATA a;
+    if(!MultiByteToWideChar(CP_UTF8,0,fname,-1,wname,1024)||!GetFileAttributesExW(wname,GetFileExInfoStandard,&a)) return 0;
+    *size=(size_t)(((unsigned long long)a.nFileSizeHigh<<32)|a.nFileSizeLow);
+    return 1;
+}
+// 文件变化通知：控制台输入等待无法同时等文件，统一用定时检查，返回-1
+int watch_open(const char *fname) { return -1; }
+int watch_drain(int wd) { return 0; }
+void watch_close(int wd) {}
+// 把已写出的内容落盘
+void file_sync(FILE *fp) { fflush(fp); _commit(_fileno(fp)); }
+// 休眠
+void sleep_ms(int ms) { Sleep(ms); }
+// 删除utf8文件名的文件
+int remove_utf8(const char *fname) {
+    char gbk_fname[512];
+    utf8_to_gbk(fname, gbk_fname, sizeof(gbk_fname));
+    return remove(gbk_fname);
+}
+// 被映射的文件不能被覆盖，保存前须先把原始缓冲复制出来
+#define MAP_SURVIVES_REPLACE 0
+// GBK 转 UTF-8（代码页 936，无效字节转为 U+FFFD）：last 为假时末尾不完整的双字节字符留给下一段；
+// 返回写出的字节数（out 至少 n*3+4 字节），*used 为读入的字节数
+size_t gbk_decode(const char *in, size_t n, char *out, size_t *used, int last) {
+    size_t i=0;
+    while(i<n) { if((unsigned char)in[i]<0x80) i++; else if(i+1<n) i+=2; else break; }
+    if(last) i=n;
+    *used=i;
+    if(!i) return 0;
+    wchar_t *wb=(wchar_t*)malloc(i*sizeof(wchar_t));
+    int wn=MultiByteToWideChar(936,0,in,(int)i,wb,(int)i);
+    int k=WideCharToMultiByte(CP_UTF8,0,wb,wn,out,(int)(i*3+4),NULL,NULL);
+    free(wb);
+    return k>0?(size_t)k:0;
+}
+// UTF-8 转 GBK（无法表示的字符写成 ?）：last 为假时末尾不完整的UTF-8字符留给下一段；out 至少 n 字节
+size_t gbk_encode(const char *in, size_t n, char *out, size_t *used, int last) {
+    size_t i=last?n:utf8_complete(in,n);
+    *used=i;
+    if(!i) return 0;
+    wchar_t *wb=(wchar_t*)malloc(i*sizeof(wchar_t));
+    int wn=MultiByteToWideChar(CP_UTF8,0,in,(int)i,wb,(int)i);
+    int k=WideCharToMultiByte(936,0,wb,wn,out,(int)i,"?",NULL);
+    free(wb);
+    return k>0?(size_t)k:0;
+}
+// 用tmp原子替换target，成功返回1
+int file_replace(const char *tmp, const char *target) {
+    wchar_t wtmp[1024], wtarget[1024];
+    if(!MultiByteToWideChar(CP_UTF8,0,tmp,-1,wtmp,1024)||!MultiByteToWideChar(CP_UTF8,0,target,-1,wtarget,1024)) return 0;
+    return MoveFileExW(wtmp,wtarget,MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH)!=0;
+}
+// 线程入口包装
+DWORD WINAPI thread_entry(LPVOID p) {
+    ThreadStart ts=*(ThreadStart*)p; free(p);
+    ts.fn(ts.arg);
+    return 0;
+}
+// 启动线程，失败返回0
+int thread_start(thread_t *t, void (*fn)(void*), void *arg) {
+    ThreadStart *ts=(ThreadStart*)malloc(sizeof(ThreadStart));
+    ts->fn=fn; ts->arg=arg;
+    *t=CreateThread(NULL,0,thread_entry,ts,0,NULL);
+    if(!*t) { free(ts); return 0; }
+    return 1;
+}
+// 等待线程结束
+void thread_join(thread_t t) { WaitForSingleObject(t,INFINITE); CloseHandle(t); }
+// 处理器数
+int cpu_count() { SYSTEM_INFO si; GetSystemInfo(&si); return (int)si.dwNumberOfProcessors; }
+// 单调时钟（纳秒）
+unsigned long long now_ns() {
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER c;
+    if(!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&c);
+    return (unsigned long long)(c.QuadPart/freq.QuadPart*1000000000ULL+c.QuadPart%freq.QuadPart*1000000000ULL/freq.QuadPart);
+}
+
+#else
+typedef pthread_t thread_t;
+struct termios orig_termios;        // 启动时的终端设置
+int termios_saved = 0;
+int pending_byte = -1;              // 预读后退回的输入字节
+
+// 写出到终端（处理部分写入）
+void term_write(const char *s, size_t n) {
+    while(n>0) {
+        ssize_t w=write(STDOUT_FILENO,s,n);
+        if(w<=0) return;
+        s+=w; n-=(size_t)w;
+    }
+}
+// 切换原始/行输入模式；保留 ISIG 与 OPOST，与 Windows 控制台行为一致
+void posix_set_raw(int raw) {
+    if(!termios_saved) return;
+    struct termios t=orig_termios;
+    if(raw) {
+        t.c_iflag&=~(ICRNL|IXON);
+        t.c_lflag&=~(ICANON|ECHO|IEXTEN);
+        t.c_cc[VMIN]=1; t.c_cc[VTIME]=0;
+    }
+    tcsetattr(STDIN_FILENO,TCSAFLUSH,&t);
+}
+// 读取一个字节；timeout_ms<0 时阻塞，超时返回-1
+int posix_getbyte(int timeout_ms) {
+    if(pending_byte>=0) { int c=pending_byte; pending_byte=-1; return c; }
+    if(timeout_ms>=0) {
+        struct pollfd pfd={STDIN_FILENO,POLLIN,0};
+        if(poll(&pfd,1,timeout_ms)<=0) return -1;
+    }
+    unsigned char c;
+    if(read(STDIN_FILENO,&c,1)!=1) return -1;
+    return c;
+}
+// 退回预读字节
+void posix_unget(int c) { pending_byte=c; }
+void swap_close(int keep);
+// 读取按键，输入结束（终端挂断、读错误）时退出；有未保存的编辑时保留交换日志供 -r 恢复
+int posix_read_key() {
+    int k=parse_key(posix_getbyte,posix_unget);
+    if(k<0) { swap_close(edit_gen!=saved_gen); exit(0); }
+    return k;
+}
+int wake_fd = -1;                   // 等待输入时也会唤醒主循环的描述符（:follow 的文件变化通知）
+// 是否有待读输入（wake_fd 可读时提前返回0；输入端挂断或出错也算，让读取走到结束处理）
+int posix_key_pending(int ms) {
+    if(pending_byte>=0) return 1;
+    struct pollfd pfd[2]={{STDIN_FILENO,POLLIN,0},{wake_fd,POLLIN,0}};
+    return poll(pfd,2,ms)>0&&(pfd[0].revents&(POLLIN|POLLHUP|POLLERR|POLLNVAL));
+}
+// 终端窗口行列数
+void posix_get_size(int *rows, int *cols) {
+    struct winsize ws;
+    if(ioctl(STDOUT_FILENO,TIOCGWINSZ,&ws)==0&&ws.ws_row&&ws.ws_col) { *rows=ws.ws_row; *cols=ws.ws_col; }
+    else { *rows=24; *cols=80; }
+}
+// 直接输出提示信息
+void posix_print(const char *s) { term_write(s,strlen(s)); }
+// 进入备用屏幕与原始模式
+void posix_init() {
+    setlocale(LC_ALL, "");
+    if(tcgetattr(STDIN_FILENO,&orig_termios)==0) termios_saved=1;
+    term_write("\x1b[?1049h\x1b[?2004h",16);
+    posix_set_raw(1);
+}
+// 恢复终端设置并离开备用屏幕
+void posix_shutdown() {
+    term_write("\x1b[?2004l\x1b[?25h\x1b[?1049l",22);
+    posix_set_raw(0);
+}
+TermBackend platform_term={"ansi",posix_init,posix_shutdown,posix_set_raw,posix_read_key,posix_key_pending,posix_get_size,
+    ansi_begin_frame,ansi_put_span,ansi_end_frame,posix_print};
+
+// POSIX 文件名本身即UTF-8
+FILE *fopen_utf8(const char *fname, const char *mode) { return fopen(fname, mode); }
+// 只读映射整个文件；成功返回1，空文件时*data为NULL
+int file_map(const char *fname, char **data, size_t *size) {
+    int fd=open(fname,O_RDONLY);
+    if(fd<0) return 0;
+    struct stat st;
+    if(fstat(fd,&st)!=0) { close(fd); return 0; }
+    *data=NULL; *size=(size_t)st.st_size;
+    if(*size) {
+        void *p=mmap(NULL,*size,PROT_READ,MAP_PRIVATE,fd,0);
+        if(p!=MAP_FAILED) *data=(char*)p;
+    }
+    close(fd);
+    return *size==0||*data!=NULL;
+}
+// 解除文件映射
+void file_unmap(char *data, size_t size) { munmap(data,size); }
+// 映射中已读过的页交还系统（只读私有映射，再访问时从文件读回）
+void file_drop(const char *data, size_t size) {
+    size_t a=(size_t)data%(size_t)sysconf(_SC_PAGESIZE);
+    madvise((void*)(data-a),size+a,MADV_DONTNEED);
+}
+// 文件当前大小；成功返回1
+int file_size_of(const char *fname, size_t *size) {
+    struct stat st;
+    if(stat(fname,&st)!=0) return 0;
+    *size=(size_t)st.st_size;
+    return 1;
+}
+// 开始监视文件的变化（Linux 用 inotify），等待按键时也会被它唤醒；不支持时返回-1，由调用方定时检查
+int watch_open(const char *fname) {
+#ifdef __linux__
+    int fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if(fd<0) return -1;
+    if(inotify_add_watch(fd,fname,IN_MODIFY|IN_ATTRIB|IN_MOVE_SELF|IN_DELETE_SELF)<0) { close(fd); return -1; }
+    wake_fd=fd;
+    return fd;
+#else
+    return -1;
+#endif
+}
+// 读空已到达的通知；返回是否有通知
+int watch_drain(int wd) {
+    char buf[4096]; int any=0;
+    while(read(wd,buf,sizeof(buf))>0) any=1;
+    return any;
+}
+void watch_close(int wd) { if(wd>=0) close(wd); if(wake_fd==wd) wake_fd=-1; }
+// 把已写出的内容落盘
+void file_sync(FILE *fp) { fflush(fp); fsync(fileno(fp)); }
+// 休眠
+void sleep_ms(int ms) { poll(NULL,0,ms); }
+// 删除文件
+int remove_utf8(const char *fname) { return remove(fname); }
+// rename 覆盖后旧文件的映射依然有效
+#define MAP_SURVIVES_REPLACE 1
+// 用 iconv 转换 in[0,n)：无效或无法表示的字符写成 bad 并跳过（utf8_in 时跳过一个UTF-8字符，否则一个字节），
+// last 为假时末尾不完整的字符留给下一段；返回写出的字节数，*used 为读入的字节数。系统不支持时原样复制
+size_t iconv_run(const char *to, const char *from, const char *in, size_t n, char *out, size_t cap, size_t *used, int last, const char *bad, int utf8_in) {
+    iconv_t cd=iconv_open(to,from);
+    if(cd==(iconv_t)-1) { memcpy(out,in,n); *used=n; return n; }
+    char *ip=(char*)in, *op=out; size_t il=n, ol=cap, k=strlen(bad);
+    while(il&&iconv(cd,&ip,&il,&op,&ol)==(size_t)-1) {
+        if(errno==E2BIG||(errno==EINVAL&&!last)||ol<k) break;
+        int cp; size_t skip=utf8_in?(size_t)utf8_decode_n(ip,il,&cp):1;
+        memcpy(op,bad,k); op+=k; ol-=k; ip+=skip; il-=skip;
+        iconv(cd,NULL,NULL,NULL,NULL);
+    }
+    iconv_close(cd);
+    *used=ip-in;
+    return op-out;
+}
+// GBK 转 UTF-8（无效字节转为 U+FFFD）：返回写出的字节数（out 至少 n*3+4 字节），*used 为读入的字节数
+size_t gbk_decode(const char *in, size_t n, char *out, size_t *used, int last) {
+    return iconv_run("UTF-8","GBK",in,n,out,n*3+4,used,last,"\xEF\xBF\xBD",0);
+}
+// UTF-8 转 GBK（无法表示的字符写成 ?）：out 至少 n 字节
+size_t gbk_encode(const char *in, size_t n, char *out, size_t *used, int last) {
+    return iconv_run("GBK","UTF-8",in,n,out,n,used,last,"?",1);
+}
+// 用tmp原子替换target（沿用target的权限），并把目录项落盘；成功返回1
+int file_replace(const char *tmp, const char *target) {
+    struct stat st;
+    if(stat(target,&st)==0) chmod(tmp,st.st_mode&07777);
+    if(rename(tmp,target)!=0) return 0;
+    char dir[1024]; const char *slash=strrchr(target,'/');
+    if(slash) snprintf(dir,sizeof(dir),"%.*s",(int)(slash-target+1),target); else strcpy(dir,".");
+    int fd=open(dir,O_RDONLY);
+    if(fd>=0) { fsync(fd); close(fd); }
+    return 1;
+}
+// 线程入口包装
+void *thread_entry(void *p) {
+    ThreadStart ts=*(ThreadStart*)p; free(p);
+    ts.fn(ts.arg);
+    return NULL;
+}
+// 启动线程，失败返回0
+int thread_start(thread_t *t, void (*fn)(void*), void *arg) {
+    ThreadStart *ts=(ThreadStart*)malloc(sizeof(ThreadStart));
+    ts->fn=fn; ts->arg=arg;
+    if(pthread_create(t,NULL,thread_entry,ts)!=0) { free(ts); return 0; }
+    return 1;
+}
+// 等待线程结束
+void thread_join(thread_t t) { pthread_join(t,NULL); }
+// 处理器数
+int cpu_count() { long n=sysconf(_SC_NPROCESSORS_ONLN); return n>0?(int)n:1; }
+// 单调时钟（纳秒）
+unsigned long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (unsigned long long)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+#endif
+
+// 初始化终端后端
+void term_init() { term=platform_term; term.init(); }
+// 退出时恢复终端
+void term_shutdown() { term.shutdown(); }
+// 设置控制台为原始输入模式
+void set_console_raw() { term.set_raw(1); }
+// 设置控制台为普通输入模式
+void set_console_normal() { term.set_raw(0); }
+unsigned perf_reads = 0;  // 已读取的按键数，延迟统计据此判断按键处理中是否等待过输入
+// 阻塞读取一个按键
+int term_getkey() { perf_reads++; return term.read_key(); }
+// 窗口行列数，限制在屏幕缓冲范围内
+void get_win_size(int *rows, int *cols) {
+    term.get_size(rows,cols);
+    if(*rows>MAX_ROWS) *rows=MAX_ROWS;
+    if(*cols>MAX_COLS_SCREEN) *cols=MAX_COLS_SCREEN;
+    if(*rows<1) *rows=1;
+    if(*cols<2) *cols=2;
+}
+// 控制台输出utf8字符串（之后需整屏重绘）
+void print_utf8(const char *utf8str) {
+    if (!utf8str) return;
+    term.print(utf8str);
+    screen_valid = 0;
+}
 
 // 获取utf8字符长度
 int utf8_len(unsigned char c) {
@@ -152,49 +889,56 @@ int utf8_len(unsigned char c) {
     else if ((c & 0xF8) == 0xF0) return 4;
     else return 1;
 }
-// 判断字符宽度：英文1，部分中文2
+// 码点属性：低2位为显示宽度，WCW_EXTEND 位表示并入前一个字形簇
+int cp_props(int cp) {
+    if(cp<0||cp>=0x110000) return 1;
+    return wcw_stage2[wcw_stage1[cp/WCW_BLOCK]][cp%WCW_BLOCK/2]>>(cp&1)*4&15;
+}
+// 码点显示宽度（0/1/2）
+int cp_width(int cp) { return cp_props(cp)&3; }
+// p起一个非ASCII字形簇的字节数：基字符加其后的组合符号、变体选择符等，ZWJ 连接下一个码点，区域指示符两两成对
+int cluster_len_mb(const char *p) {
+    int cp, n=utf8_decode(p,&cp);
+    if(cp>=0x1F1E6&&cp<=0x1F1FF) {
+        int cp2, n2=utf8_decode(p+n,&cp2);
+        if(cp2>=0x1F1E6&&cp2<=0x1F1FF) return n+n2;
+    }
+    while(p[n]) {
+        int next, k=utf8_decode(p+n,&next);
+        if(!(cp_props(next)&WCW_EXTEND)) break;
+        n+=k;
+        if(next==0x200D&&p[n]) n+=utf8_decode(p+n,&next);
+    }
+    return n;
+}
+// s[pos]起一个字形簇的字节数；ASCII 后跟 ASCII 时直接为1
+int cluster_len(const char *s, int pos) {
+    const char *p=s+pos;
+    if((unsigned char)p[0]<0x80&&(unsigned char)p[1]<0x80) return 1;
+    return cluster_len_mb(p);
+}
+// p起一个非ASCII字形簇的显示宽度：取基字符宽度，emoji 变体选择符与成对的区域指示符（旗帜）占两列；无基字符的零宽簇按一列显示
+int char_width_mb(const char *p) {
+    int cp, n=utf8_decode(p,&cp), w=cp_width(cp);
+    if(w==0) return 1;
+    if(cp>=0x1F1E6&&cp<=0x1F1FF) return cluster_len_mb(p)>n?2:1;
+    if(w==1&&(unsigned char)p[n]==0xEF&&(unsigned char)p[n+1]==0xB8&&(unsigned char)p[n+2]==0x8F) return 2;
+    return w;
+}
+// s[pos]起一个字形簇的显示宽度
 int char_width(const char *s, int pos) {
-    unsigned char c = (unsigned char)s[pos];
-    if (c < 0x80) return 1;
-    else if ((c & 0xE0) == 0xC0) return 1;
-    else if ((c & 0xF0) == 0xE0) return 2;
-    else if ((c & 0xF8) == 0xF0) return 2;
-    else return 1;
+    if((unsigned char)s[pos]<0x80) return 1;
+    return char_width_mb(s+pos);
 }
 // 计算字符串的可见宽度（列数）
 int str_vis_width(const char *s) {
     int w=0;
     for(int i=0;s[i];) {
         w+=char_width(s,i);
-        i+=utf8_len((unsigned char)s[i]);
+        i+=cluster_len(s,i);
     }
     return w;
 }
-// 可见宽度转实际字节位置（用于插入/删除等）
-int vis2real(const char *s, int vis) {
-    int width=0,i=0;
-    while(s[i]&&width<vis) {
-        int w=char_width(s,i),clen=utf8_len((unsigned char)s[i]);
-        if(width+w>vis) break;
-        width+=w;
-        i+=clen;
-    }
-    return i;
-}
-// 删除指定可见宽度位置的字符
-void delvis(char *s, int vis) {
-    int pos=vis2real(s,vis);
-    if(!s[pos]) return;
-    int del=utf8_len((unsigned char)s[pos]);
-    memmove(&s[pos],&s[pos+del],strlen(&s[pos+del])+1);
-}
-// 在指定可见宽度位置插入字符
-void insvis(char *s, int vis, const char *ins, int inslen) {
-    int pos=vis2real(s,vis), slen=strlen(s);
-    if(slen+inslen>=MAX_COLS-1) return;
-    memmove(&s[pos+inslen],&s[pos],slen-pos+1);
-    memcpy(&s[pos],ins,inslen);
-}
 // 去除字符串前后空白
 void trim(char *s) {
     char *p=s;
@@ -203,81 +947,1725 @@ void trim(char *s) {
     p=s+strlen(s)-1;
     while(p>=s&&(*p==' '||*p=='\t')) *p--=0;
 }
-// 不区分大小写查找子串
-char *strcasestr2(const char *h, const char *n) {
-    if (!*n) return (char*)h;
-    for (; *h; h++) {
-        const char *hh=h,*nn=n;
-        while(*hh&&*nn&&tolower((unsigned char)*hh)==tolower((unsigned char)*nn)) hh++,nn++;
-        if(!*nn) return (char*)h;
+// ------------- 延迟统计 -------------
+// 主循环各阶段常开计时：每个样本按对数-线性分桶计入固定大小的直方图（每个2的幂区间再分 PERF_SUB 格，
+// 相对误差不超过 1/PERF_SUB），记录只需几次整数运算；相邻阶段共用时间戳，每个阶段边界只读一次时钟。
+// 按键处理中又等待了输入（进入命令行、确认提示等）的样本含有用户思考时间，不计入。
+
+// 计时的阶段
+enum { PERF_READ, PERF_DISPATCH, PERF_SCROLL, PERF_BUILD, PERF_FLUSH, PERF_KEY, PERF_PHASES };
+// 一个阶段的延迟直方图
+typedef struct {
+    unsigned count[PERF_BUCKETS];
+    unsigned long long n, max;
+} PerfHist;
+PerfHist perf_hist[PERF_PHASES];
+const char *perf_names[PERF_PHASES] = { "读取输入", "按键处理", "滚动调整", "构建画面", "输出终端", "整次按键" };
+
+// ns所在的桶：小于 PERF_SUB 的值各占一桶，之后每个2的幂区间 PERF_SUB 桶
+int perf_bucket(unsigned long long ns) {
+    if(ns<PERF_SUB) return (int)ns;
+    int e=63-__builtin_clzll(ns), b=(e-PERF_SUB_BITS+1)*PERF_SUB+(int)((ns>>(e-PERF_SUB_BITS))&(PERF_SUB-1));
+    return b<PERF_BUCKETS?b:PERF_BUCKETS-1;
+}
+// 桶内的最大值
+unsigned long long perf_bucket_top(int b) {
+    if(b<PERF_SUB) return (unsigned long long)b;
+    int e=b/PERF_SUB+PERF_SUB_BITS-1;
+    return ((unsigned long long)(PERF_SUB+b%PERF_SUB+1)<<(e-PERF_SUB_BITS))-1;
+}
+// 记录一个样本
+void perf_add(int phase, unsigned long long ns) {
+    PerfHist *h=&perf_hist[phase];
+    h->count[perf_bucket(ns)]++; h->n++;
+    if(ns>h->max) h->max=ns;
+}
+// 记录从t到现在的耗时，返回现在的时刻（作为下一阶段的起点）
+unsigned long long perf_mark(int phase, unsigned long long t) {
+    unsigned long long now=now_ns();
+    perf_add(phase,now-t);
+    return now;
+}
+// 第q分位的延迟（所在桶的上界，不超过最大值）
+unsigned long long perf_quantile(const PerfHist *h, double q) {
+    unsigned long long need=(unsigned long long)(q*h->n+0.999999), seen=0;
+    if(!need) need=1;
+    for(int b=0;b<PERF_BUCKETS;b++) {
+        seen+=h->count[b];
+        if(seen>=need) { unsigned long long v=perf_bucket_top(b); return v<h->max?v:h->max; }
+    }
+    return h->max;
+}
+// 清空统计
+void perf_reset() { memset(perf_hist,0,sizeof(perf_hist)); }
+// 各阶段的 p50/p90/p99/max（微秒）
+void perf_report(char *out, size_t size) {
+    int n=snprintf(out,size,"按键延迟（微秒）        次数       p50       p90       p99       max\n");
+    for(int i=0;i<PERF_PHASES&&n<(int)size;i++) {
+        const PerfHist *h=&perf_hist[i];
+        n+=snprintf(out+n,size-n,"%s%20llu %9.1f %9.1f %9.1f %9.1f\n",perf_names[i],h->n,
+            perf_quantile(h,0.5)/1e3,perf_quantile(h,0.9)/1e3,perf_quantile(h,0.99)/1e3,h->max/1e3);
+    }
+}
+// ------------- 内存池 -------------
+// 片段节点与撤销记录数量多、大小不一且频繁增删，从各自的池中按尺寸类分配，避免大量零碎 malloc；
+// 关闭文档时整池释放，空闲过多时由使用者把存活对象搬到新池（压缩）。
+
+// 不超过n字节的最小尺寸类，超过最大类时返回 POOL_CLASSES
+int pool_class(size_t n) {
+    int c=0;
+    while(c<POOL_CLASSES&&((size_t)16<<c)<n) c++;
+    return c;
+}
+void pool_link(PoolChunk **head, PoolChunk *c) {
+    c->prev=NULL; c->next=*head;
+    if(*head) (*head)->prev=c;
+    *head=c;
+}
+void pool_unlink(PoolChunk **head, PoolChunk *c) {
+    if(c->prev) c->prev->next=c->next; else *head=c->next;
+    if(c->next) c->next->prev=c->prev;
+}
+// 分配n字节（内容未初始化）
+void *pool_alloc(Pool *p, size_t n) {
+    int c=pool_class(n);
+    if(c==POOL_CLASSES) {
+        PoolChunk *b=(PoolChunk*)malloc(sizeof(PoolChunk)+n);
+        b->size=n; pool_link(&p->bigs,b);
+        p->used+=n; p->big+=n; p->reserved+=sizeof(PoolChunk)+n;
+        return b+1;
+    }
+    size_t sz=(size_t)16<<c;
+    p->used+=sz;
+    if(p->free_list[c]) { void *r=p->free_list[c]; p->free_list[c]=*(void**)r; return r; }
+    if(p->cur_left<sz) {
+        PoolChunk *s=(PoolChunk*)malloc(sizeof(PoolChunk)+POOL_SLAB);
+        s->size=POOL_SLAB; pool_link(&p->slabs,s);
+        p->reserved+=sizeof(PoolChunk)+POOL_SLAB; p->nslabs++;
+        p->cur=(char*)(s+1); p->cur_left=POOL_SLAB;
+    }
+    void *r=p->cur; p->cur+=sz; p->cur_left-=sz;
+    return r;
+}
+// 释放 pool_alloc 得到的n字节（n须与分配时一致）
+void pool_free(Pool *p, void *ptr, size_t n) {
+    if(!ptr) return;
+    int c=pool_class(n);
+    if(c==POOL_CLASSES) {
+        PoolChunk *b=(PoolChunk*)ptr-1;
+        pool_unlink(&p->bigs,b);
+        p->used-=n; p->big-=n; p->reserved-=sizeof(PoolChunk)+n;
+        free(b); return;
+    }
+    *(void**)ptr=p->free_list[c]; p->free_list[c]=ptr;
+    p->used-=(size_t)16<<c;
+}
+// 把old字节的块改为n字节，同一尺寸类内原地不动
+void *pool_realloc(Pool *p, void *ptr, size_t old, size_t n) {
+    if(!ptr) return pool_alloc(p,n);
+    int c=pool_class(old), d=pool_class(n);
+    if(c==d&&c<POOL_CLASSES) return ptr;
+    if(c==POOL_CLASSES&&d==POOL_CLASSES) {
+        PoolChunk *b=(PoolChunk*)ptr-1;
+        pool_unlink(&p->bigs,b);
+        b=(PoolChunk*)realloc(b,sizeof(PoolChunk)+n);
+        b->size=n; pool_link(&p->bigs,b);
+        p->used+=n-old; p->big+=n-old; p->reserved+=n-old;
+        return b+1;
+    }
+    void *r=pool_alloc(p,n);
+    memcpy(r,ptr,old<n?old:n);
+    pool_free(p,ptr,old);
+    return r;
+}
+// 整池释放
+void pool_reset(Pool *p) {
+    while(p->slabs) { PoolChunk *n=p->slabs->next; free(p->slabs); p->slabs=n; }
+    while(p->bigs) { PoolChunk *n=p->bigs->next; free(p->bigs); p->bigs=n; }
+    memset(p,0,sizeof(*p));
+}
+// 大块中空闲的部分超过存活对象且至少有几个大块时值得压缩
+int pool_fragmented(const Pool *p) {
+    return p->nslabs>=4&&(size_t)p->nslabs*POOL_SLAB>2*(p->used-p->big);
+}
+
+// ------------- 片表文本缓冲 -------------
+// 文本 = 原始缓冲(文件内容，只读) + 添加缓冲(只追加)，片段树按文档顺序引用两者的区间。
+// 插入/删除只拆分、拼接片段；按行号定位借助各缓冲的换行位置索引，均为 O(log n)。
+
+// 取片段所属缓冲
+TextBuf *tbuf(int buf) { return buf==BUF_ORIG?&orig_buf:&add_buf; }
+
+// 树堆优先级随机数
+unsigned pt_rand() {
+    static unsigned x=2463534242u;
+    x^=x<<13; x^=x>>17; x^=x<<5;
+    return x;
+}
+
+// pos之前的换行数（即完整换行位置索引中第一个不小于pos的下标）；稀疏索引先二分到检查点，再数其后的换行
+size_t nl_lower(const TextBuf *b, size_t pos) {
+    size_t lo=0, hi=b->nl_count;
+    while(lo<hi) { size_t mid=lo+(hi-lo)/2; if(b->nl[mid]<pos) lo=mid+1; else hi=mid; }
+    if(!b->nl_step) return lo;
+    const char *p=b->data+(lo?b->nl[lo-1]+1:0), *e=b->data+pos;
+    size_t n=lo*b->nl_step;
+    while(p<e&&(p=(const char*)memchr(p,'\n',e-p))) { n++; p++; }
+    return n;
+}
+// 第i个换行（从0起）的位置；稀疏索引从前一个检查点起最多数 nl_step 个换行
+size_t nl_at(const TextBuf *b, size_t i) {
+    if(!b->nl_step) return b->nl[i];
+    size_t k=(i+1)/b->nl_step, n=i+1-k*b->nl_step;
+    if(!n) return b->nl[k-1];
+    const char *p=b->data+(k?b->nl[k-1]+1:0), *e=b->data+b->len;
+    while(1) { p=(const char*)memchr(p,'\n',e-p); if(!--n) return p-b->data; p++; }
+}
+// 缓冲区间[start,start+len)内的换行数
+size_t buf_lf(int buf, size_t start, size_t len) {
+    TextBuf *b=tbuf(buf);
+    return nl_lower(b,start+len)-nl_lower(b,start);
+}
+// 记录换行位置
+void textbuf_add_nl(TextBuf *b, size_t pos) {
+    if(b->nl_count==b->nl_cap) {
+        b->nl_cap=b->nl_cap?b->nl_cap*2:1024;
+        b->nl=(size_t*)realloc(b->nl,b->nl_cap*sizeof(size_t));
+    }
+    b->nl[b->nl_count++]=pos;
+}
+// 向缓冲追加内容并索引其中的换行
+void textbuf_append(TextBuf *b, const char *s, size_t n) {
+    if(b->len+n>b->cap) {
+        while(b->len+n>b->cap) b->cap=b->cap?b->cap*2:4096;
+        if(b->data&&b->data==b->pinned) { char *d=(char*)malloc(b->cap); memcpy(d,b->data,b->len); b->data=d; }
+        else b->data=(char*)realloc(b->data,b->cap);
+    }
+    memcpy(b->data+b->len,s,n);
+    for(size_t i=0;i<n;i++) if(s[i]=='\n') textbuf_add_nl(b,b->len+i);
+    b->len+=n;
+}
+// 索引缓冲末尾新接上的[from,to)内的换行（from之前的都已索引）
+void textbuf_index_tail(TextBuf *b, size_t from, size_t to) {
+    size_t seen=b->nl_step?nl_lower(b,from):0;
+    const char *p=b->data+from, *e=b->data+to;
+    while(p<e&&(p=(const char*)memchr(p,'\n',e-p))) {
+        if(!b->nl_step||++seen%b->nl_step==0) textbuf_add_nl(b,p-b->data);
+        p++;
+    }
+}
+// 快照不再读取后释放被换下的数据块
+void textbuf_unpin(TextBuf *b) {
+    if(b->pinned&&b->pinned!=b->data) free(b->pinned);
+    b->pinned=NULL;
+}
+// 释放缓冲
+void textbuf_free(TextBuf *b) {
+    if(b->mapped) file_unmap(b->data,b->len); else free(b->data);
+    free(b->nl);
+    memset(b,0,sizeof(*b));
+}
+// 把映射的缓冲复制到堆上并解除映射（覆盖写源文件前调用，避免截断仍在映射中的文件）
+void textbuf_detach(TextBuf *b) {
+    if(!b->mapped) return;
+    char *copy=(char*)malloc(b->len?b->len:1);
+    memcpy(copy,b->data,b->len);
+    file_unmap(b->data,b->len);
+    b->data=copy; b->mapped=0;
+}
+
+// 换行扫描分块任务
+typedef struct {
+    const char *data;
+    size_t begin, end;
+    size_t *nl;
+    size_t count, cap;
+} NlScanJob;
+// 扫描一个分块内的换行位置
+void nl_scan_worker(void *arg) {
+    NlScanJob *j=(NlScanJob*)arg;
+    const char *p=j->data+j->begin, *e=j->data+j->end;
+    j->cap=(j->end-j->begin)/64+16; j->nl=(size_t*)malloc(j->cap*sizeof(size_t)); j->count=0;
+    while(p<e&&(p=(const char*)memchr(p,'\n',e-p))) {
+        if(j->count==j->cap) { j->cap*=2; j->nl=(size_t*)realloc(j->nl,j->cap*sizeof(size_t)); }
+        j->nl[j->count++]=p-j->data; p++;
+    }
+}
+// 为缓冲建立换行位置索引：大缓冲按处理器数分块并行扫描后拼接
+void textbuf_index(TextBuf *b) {
+    int n=1;
+    if(b->len>=NL_SCAN_PAR_MIN) {
+        n=cpu_count();
+        if(n<1) n=1;
+        if(n>NL_SCAN_MAX_THREADS) n=NL_SCAN_MAX_THREADS;
+    }
+    NlScanJob jobs[NL_SCAN_MAX_THREADS]; thread_t th[NL_SCAN_MAX_THREADS]; int started[NL_SCAN_MAX_THREADS]={0};
+    for(int i=0;i<n;i++) { jobs[i].data=b->data; jobs[i].begin=b->len*i/n; jobs[i].end=b->len*(i+1)/n; }
+    for(int i=1;i<n;i++) {
+        started[i]=thread_start(&th[i],nl_scan_worker,&jobs[i]);
+        if(!started[i]) nl_scan_worker(&jobs[i]);
+    }
+    nl_scan_worker(&jobs[0]);
+    size_t total=0;
+    for(int i=0;i<n;i++) {
+        if(started[i]) thread_join(th[i]);
+        total+=jobs[i].count;
+    }
+    free(b->nl);
+    b->nl=(size_t*)malloc((total?total:1)*sizeof(size_t)); b->nl_count=0; b->nl_cap=total?total:1;
+    for(int i=0;i<n;i++) {
+        memcpy(b->nl+b->nl_count,jobs[i].nl,jobs[i].count*sizeof(size_t));
+        b->nl_count+=jobs[i].count; free(jobs[i].nl);
+    }
+}
+
+// 新建片段节点
+Piece *piece_new(int buf, size_t start, size_t len) {
+    Piece *p=(Piece*)pool_alloc(&piece_pool,sizeof(Piece));
+    memset(p,0,sizeof(Piece));
+    p->ref=1; p->pri=pt_rand(); p->buf=buf; p->start=start; p->len=len;
+    p->lf=buf_lf(buf,start,len);
+    p->sum_len=len; p->sum_lf=p->lf;
+    return p;
+}
+// 重新计算子树统计
+void piece_pull(Piece *p) {
+    p->sum_len=p->len; p->sum_lf=p->lf;
+    if(p->l) { p->sum_len+=p->l->sum_len; p->sum_lf+=p->l->sum_lf; }
+    if(p->r) { p->sum_len+=p->r->sum_len; p->sum_lf+=p->r->sum_lf; }
+}
+// 取得可修改的节点：被共享时复制一份（子树随之多一个引用），调用者对t的引用转给副本
+Piece *pt_own(Piece *t) {
+    if(t->ref==1) return t;
+    Piece *p=(Piece*)pool_alloc(&piece_pool,sizeof(Piece));
+    *p=*t; p->ref=1; t->ref--;
+    if(p->l) p->l->ref++;
+    if(p->r) p->r->ref++;
+    return p;
+}
+// 合并两棵树（a中片段全部在b之前）
+Piece *pt_merge(Piece *a, Piece *b) {
+    if(!a) return b;
+    if(!b) return a;
+    if(a->pri>=b->pri) { a=pt_own(a); a->r=pt_merge(a->r,b); piece_pull(a); return a; }
+    b=pt_own(b); b->l=pt_merge(a,b->l); piece_pull(b); return b;
+}
+// 按字节偏移拆分：前off字节进a，其余进b；偏移落在片段内部时拆开该片段
+void pt_split(Piece *t, size_t off, Piece **a, Piece **b) {
+    if(!t) { *a=*b=NULL; return; }
+    t=pt_own(t);
+    size_t ll=t->l?t->l->sum_len:0;
+    if(off<=ll) { pt_split(t->l,off,a,&t->l); piece_pull(t); *b=t; }
+    else if(off>=ll+t->len) { pt_split(t->r,off-ll-t->len,&t->r,b); piece_pull(t); *a=t; }
+    else {
+        size_t k=off-ll;
+        Piece *right=piece_new(t->buf,t->start+k,t->len-k);
+        right->pri=t->pri; right->r=t->r; t->r=NULL;
+        t->len=k; t->lf-=right->lf;
+        piece_pull(right); piece_pull(t);
+        *a=t; *b=right;
+    }
+}
+// 把树中最后一个片段延长n字节（含lf个换行）
+Piece *pt_grow_last(Piece *t, size_t n, size_t lf) {
+    t=pt_own(t);
+    if(t->r) t->r=pt_grow_last(t->r,n,lf); else { t->len+=n; t->lf+=lf; }
+    piece_pull(t);
+    return t;
+}
+// 放弃对子树的一个引用，引用数归零的节点释放
+void pt_release(Piece *t) {
+    if(!t||--t->ref) return;
+    pt_release(t->l); pt_release(t->r); pool_free(&piece_pool,t,sizeof(Piece));
+}
+// 按文档顺序把子树复制到池to中
+Piece *pt_copy(const Piece *t, Pool *to) {
+    if(!t) return NULL;
+    Piece *l=pt_copy(t->l,to);
+    Piece *p=(Piece*)pool_alloc(to,sizeof(Piece));
+    *p=*t; p->ref=1; p->l=l; p->r=pt_copy(t->r,to);
+    return p;
+}
+// 压缩片段池：整棵树搬到新池（节点按文档顺序连续存放），旧池整体释放
+void pt_compact() {
+    Pool fresh; memset(&fresh,0,sizeof(fresh));
+    pt_root=pt_copy(pt_root,&fresh);
+    pool_reset(&piece_pool); piece_pool=fresh;
+}
+// 文档总字节数
+size_t pt_length() { return pt_root?pt_root->sum_len:0; }
+// 文档总行数
+size_t pt_lines() { return (pt_root?pt_root->sum_lf:0)+1; }
+
+// 在偏移off处插入n字节
+void pt_insert(size_t off, const char *s, size_t n) {
+    if(!n) return;
+    size_t start=add_buf.len;
+    textbuf_append(&add_buf,s,n);
+    Piece *a,*b;
+    pt_split(pt_root,off,&a,&b);
+    Piece *last=a;
+    while(last&&last->r) last=last->r;
+    // 紧接上次输入时延长最后一个片段，否则新建片段
+    if(last&&last->buf==BUF_ADD&&last->start+last->len==start) a=pt_grow_last(a,n,buf_lf(BUF_ADD,start,n));
+    else a=pt_merge(a,piece_new(BUF_ADD,start,n));
+    pt_root=pt_merge(a,b);
+}
+// 删除偏移off起的n字节
+void pt_delete(size_t off, size_t n) {
+    if(!n) return;
+    Piece *a,*m,*b;
+    pt_split(pt_root,off,&a,&b);
+    pt_split(b,n,&m,&b);
+    pt_release(m);
+    pt_root=pt_merge(a,b);
+}
+// 第line行（从0起）首字节的偏移
+size_t pt_line_start(size_t line) {
+    Piece *t=pt_root; size_t off=0;
+    if(line==0) return 0;
+    while(t) {
+        size_t llf=t->l?t->l->sum_lf:0, llen=t->l?t->l->sum_len:0;
+        if(line<=llf) { t=t->l; continue; }
+        line-=llf; off+=llen;
+        if(line<=t->lf) {
+            TextBuf *b=tbuf(t->buf);
+            return off+(nl_at(b,nl_lower(b,t->start)+line-1)-t->start)+1;
+        }
+        line-=t->lf; off+=t->len; t=t->r;
+    }
+    return off;
+}
+// 按文档顺序访问与[off,end)重叠的各片段内容，visit返回非0时提前结束
+typedef int (*PieceVisitor)(const char *p, size_t n, size_t off, void *ctx);
+int pt_walk(const Piece *t, size_t base, size_t off, size_t end, PieceVisitor visit, void *ctx) {
+    if(!t||off>=end) return 0;
+    size_t ll=t->l?t->l->sum_len:0, ps=base+ll, pe=ps+t->len;
+    if(off<ps&&pt_walk(t->l,base,off,end,visit,ctx)) return 1;
+    if(off<pe&&end>ps) {
+        size_t a=off>ps?off:ps, b=end<pe?end:pe;
+        if(visit(tbuf(t->buf)->data+t->start+(a-ps),b-a,a,ctx)) return 1;
+    }
+    if(end>pe) return pt_walk(t->r,pe,off,end,visit,ctx);
+    return 0;
+}
+// 复制访问器：依次拷贝到目标内存
+int pt_copy_visit(const char *p, size_t n, size_t off, void *ctx) {
+    char **dst=(char**)ctx;
+    memcpy(*dst,p,n); *dst+=n;
+    return 0;
+}
+// 读取[off,off+n)到dst
+void pt_read(size_t off, size_t n, char *dst) {
+    pt_walk(pt_root,0,off,off+n,pt_copy_visit,&dst);
+}
+// 以data（接管所有权，mapped表示文件映射）作为原始缓冲重建文档；文档只引用从start起的len字节
+void pt_load(char *data, size_t size, size_t start, size_t len, int mapped) {
+    pool_reset(&piece_pool); pt_root=NULL;
+    textbuf_free(&orig_buf); textbuf_free(&add_buf);
+    orig_buf.data=data; orig_buf.len=orig_buf.cap=size; orig_buf.mapped=mapped;
+    textbuf_index(&orig_buf);
+    if(len) pt_root=piece_new(BUF_ORIG,start,len);
+}
+
+// 第i行首字节偏移
+size_t line_off(int i) { return pt_line_start((size_t)i); }
+// 第i行字节长度（不含换行；只读查看时与 line_slot 一样不含行尾的 \r）
+size_t line_len(int i) {
+    size_t s=pt_line_start((size_t)i);
+    size_t e=(i+1<line_count)?pt_line_start((size_t)i+1)-1:pt_length();
+    if(view_mode&&e>s) { char c; pt_read(e-1,1,&c); if(c=='\r') e--; }
+    return e-s;
+}
+// 偏移off之前的换行数，即off所在行号
+size_t pt_line_of(size_t off) {
+    Piece *t=pt_root; size_t line=0;
+    while(t) {
+        size_t llen=t->l?t->l->sum_len:0;
+        if(off<=llen) { t=t->l; continue; }
+        line+=t->l?t->l->sum_lf:0; off-=llen;
+        if(off<t->len) return line+buf_lf(t->buf,t->start,off);
+        line+=t->lf; off-=t->len; t=t->r;
+    }
+    return line;
+}
+
+// ------------- 行缓存 -------------
+// 行内容按需从片表读出，首次需要列信息时一次扫描得到显示宽度与列→字节检查点，
+// 之后取宽度为 O(1)，列/字节互换、光标左右移动只需二分检查点再扫描不超过 LINE_CKPT 个字符。
+
+// 取第i行的缓存槽，未命中时从片表读出内容
+LineSlot *line_slot(int i) {
+    LineSlot *ls=&line_cache[i%LINE_CACHE];
+    if(ls->valid&&ls->line==i) return ls;
+    size_t s=pt_line_start((size_t)i);
+    size_t e=(i+1<line_count)?pt_line_start((size_t)i+1)-1:pt_length();
+    if(e-s+1>ls->cap) { ls->cap=e-s+1; ls->text=(char*)realloc(ls->text,ls->cap); }
+    pt_read(s,e-s,ls->text);
+    if(view_mode&&e>s&&ls->text[e-s-1]=='\r') e--;  // 只读查看不归一化 \r\n，显示时去掉行尾的 \r
+    ls->text[e-s]=0;
+    ls->len=(int)(e-s); ls->nck=0; ls->width=-1; ls->line=i; ls->valid=1;
+    return ls;
+}
+// 取第i行的缓存槽并确保宽度与检查点已建立（一次扫描）
+LineSlot *line_metrics(int i) {
+    LineSlot *ls=line_slot(i);
+    if(ls->width>=0) return ls;
+    int w=0, n=0;
+    for(int j=0;j<ls->len;n++) {
+        if(n%LINE_CKPT==0) {
+            if(ls->nck==ls->ck_cap) { ls->ck_cap=ls->ck_cap?ls->ck_cap*2:8; ls->ck=(ColCkpt*)realloc(ls->ck,ls->ck_cap*sizeof(ColCkpt)); }
+            ls->ck[ls->nck].pos=j; ls->ck[ls->nck].col=w; ls->nck++;
+        }
+        w+=char_width(ls->text,j);
+        j+=cluster_len(ls->text,j);
+    }
+    ls->width=w;
+    return ls;
+}
+// 取第i行内容（以0结尾）；返回的指针在下次编辑或取用同槽的其他行之前有效
+const char *line_get(int i) { return line_slot(i)->text; }
+// 第i行显示宽度
+int line_width(int i) { return line_metrics(i)->width; }
+// 列不超过col的最后一个检查点
+const ColCkpt *ckpt_by_col(const LineSlot *ls, int col) {
+    int lo=0, hi=ls->nck-1;
+    if(hi<0) return NULL;
+    while(lo<hi) { int mid=(lo+hi+1)/2; if(ls->ck[mid].col<=col) lo=mid; else hi=mid-1; }
+    return &ls->ck[lo];
+}
+// 字节位置不超过pos的最后一个检查点
+const ColCkpt *ckpt_by_pos(const LineSlot *ls, int pos) {
+    int lo=0, hi=ls->nck-1;
+    if(hi<0) return NULL;
+    while(lo<hi) { int mid=(lo+hi+1)/2; if(ls->ck[mid].pos<=pos) lo=mid; else hi=mid-1; }
+    return &ls->ck[lo];
+}
+// 第y行可见宽度转实际字节位置（用于插入/删除等）
+int line_vis2real(int y, int vis) {
+    LineSlot *ls=line_metrics(y);
+    const ColCkpt *c=ckpt_by_col(ls,vis);
+    if(!c) return 0;
+    int width=c->col, i=c->pos;
+    while(ls->text[i]&&width<vis) {
+        int w=char_width(ls->text,i);
+        if(width+w>vis) break;
+        width+=w; i+=cluster_len(ls->text,i);
+    }
+    return i;
+}
+// 第y行字节位置（字符起点）对应的列
+int line_real2vis(int y, int pos) {
+    LineSlot *ls=line_metrics(y);
+    const ColCkpt *c=ckpt_by_pos(ls,pos);
+    if(!c) return 0;
+    int width=c->col, i=c->pos;
+    while(i<pos&&ls->text[i]) { width+=char_width(ls->text,i); i+=cluster_len(ls->text,i); }
+    return width;
+}
+// 第y行光标左移：返回起点在cx之前的最后一个字符的列
+int line_move_left(int y, int cx) {
+    if(cx<=0) return 0;
+    LineSlot *ls=line_metrics(y);
+    const ColCkpt *c=ckpt_by_col(ls,cx-1);
+    if(!c) return 0;
+    int col=c->col, i=c->pos, last=col;
+    while(ls->text[i]&&col<cx) { last=col; col+=char_width(ls->text,i); i+=cluster_len(ls->text,i); }
+    return last;
+}
+// 第y行光标右移：cx处恰为字符起点时移到其后
+int line_move_right(int y, int cx) {
+    LineSlot *ls=line_metrics(y);
+    int pos=line_vis2real(y,cx);
+    if(!ls->text[pos]||line_real2vis(y,pos)!=cx) return cx;
+    return cx+char_width(ls->text,pos);
+}
+// 编辑后调整行缓存：first行起的removed+1行合并/改写为added+1行，其前的行不变，其后的行号平移
+void line_cache_edit(int first, int removed, int added) {
+    LineSlot moved[LINE_CACHE]; int nm=0;
+    for(int k=0;k<LINE_CACHE;k++) {
+        LineSlot *ls=&line_cache[k];
+        if(!ls->valid||ls->line<first) continue;
+        if(ls->line<=first+removed) { ls->valid=0; continue; }
+        if(added==removed) continue;
+        moved[nm]=*ls; moved[nm++].line+=added-removed;
+        memset(ls,0,sizeof(*ls));
+    }
+    for(int k=0;k<nm;k++) {
+        LineSlot *dst=&line_cache[moved[k].line%LINE_CACHE];
+        if(dst->valid) { free(moved[k].text); free(moved[k].ck); continue; }
+        free(dst->text); free(dst->ck);
+        *dst=moved[k];
+    }
+}
+// 整个文档替换后清空行缓存
+void line_cache_reset() {
+    for(int k=0;k<LINE_CACHE;k++) line_cache[k].valid=0;
+}
+// 统计换行数
+int count_nl(const char *s, size_t n) {
+    int c=0;
+    for(const char *p=s,*e=s+n;p<e&&(p=(const char*)memchr(p,'\n',e-p));p++) c++;
+    return c;
+}
+
+void undo_record(int del, size_t off, char *text, size_t n);
+void match_index_edit(int first, int removed, int added);
+// 编辑后同步行数
+void buf_changed() { line_count=(int)pt_lines(); edit_gen++; }
+// ------------- 语法高亮 -------------
+// 按语法表逐行扫描：注释、字符串、数字、关键字等按类别着色。只有块注释与三引号字符串会跨行，
+// 为此缓存每行行末的扫描状态；编辑后从第一处改动的行重新扫描，过了改动范围后一旦算出的行末状态与缓存相同
+// 即可停止，其后的行都不受影响。一次按键通常只重扫几行，与文件大小无关。没有跨行结构的语法不缓存状态。
+
+// 行末扫描状态
+enum { HS_NONE, HS_BLOCK, HS_TRIPLE_DQ, HS_TRIPLE_SQ };
+// 语法表的可选特性
+enum { HLF_NUMBER=1, HLF_PREPROC=2, HLF_KEY=4, HLF_TRIPLE=8 };
+
+// 关键字及其类别
+typedef struct { const char *word; unsigned char cls; } HlWord;
+// 一种语法
+typedef struct {
+    const char *name;
+    const char *ext;         // 扩展名，空格分隔
+    const char *comment;     // 行注释
+    const char *block[2];    // 块注释的起止
+    const char *quotes;      // 字符串定界符
+    const HlWord *words;     // 以 {NULL} 结尾
+    int flags;
+} Syntax;
+
+const HlWord c_words[] = {
+    {"if",HL_KEYWORD},{"else",HL_KEYWORD},{"for",HL_KEYWORD},{"while",HL_KEYWORD},{"do",HL_KEYWORD},
+    {"switch",HL_KEYWORD},{"case",HL_KEYWORD},{"default",HL_KEYWORD},{"break",HL_KEYWORD},{"continue",HL_KEYWORD},
+    {"return",HL_KEYWORD},{"goto",HL_KEYWORD},{"sizeof",HL_KEYWORD},{"typedef",HL_KEYWORD},{"struct",HL_KEYWORD},
+    {"union",HL_KEYWORD},{"enum",HL_KEYWORD},{"static",HL_KEYWORD},{"extern",HL_KEYWORD},{"const",HL_KEYWORD},
+    {"volatile",HL_KEYWORD},{"inline",HL_KEYWORD},{"class",HL_KEYWORD},{"public",HL_KEYWORD},{"private",HL_KEYWORD},
+    {"protected",HL_KEYWORD},{"namespace",HL_KEYWORD},{"template",HL_KEYWORD},{"new",HL_KEYWORD},{"delete",HL_KEYWORD},
+    {"NULL",HL_NUMBER},{"true",HL_NUMBER},{"false",HL_NUMBER},{"nullptr",HL_NUMBER},
+    {"void",HL_TYPE},{"char",HL_TYPE},{"short",HL_TYPE},{"int",HL_TYPE},{"long",HL_TYPE},{"float",HL_TYPE},
+    {"double",HL_TYPE},{"signed",HL_TYPE},{"unsigned",HL_TYPE},{"bool",HL_TYPE},{"size_t",HL_TYPE},{"auto",HL_TYPE},
+    {NULL}
+};
+const HlWord json_words[] = { {"true",HL_NUMBER},{"false",HL_NUMBER},{"null",HL_NUMBER},{NULL} };
+const HlWord py_words[] = {
+    {"def",HL_KEYWORD},{"class",HL_KEYWORD},{"if",HL_KEYWORD},{"elif",HL_KEYWORD},{"else",HL_KEYWORD},
+    {"for",HL_KEYWORD},{"while",HL_KEYWORD},{"in",HL_KEYWORD},{"not",HL_KEYWORD},{"and",HL_KEYWORD},{"or",HL_KEYWORD},
+    {"is",HL_KEYWORD},{"return",HL_KEYWORD},{"yield",HL_KEYWORD},{"import",HL_KEYWORD},{"from",HL_KEYWORD},
+    {"as",HL_KEYWORD},{"with",HL_KEYWORD},{"try",HL_KEYWORD},{"except",HL_KEYWORD},{"finally",HL_KEYWORD},
+    {"raise",HL_KEYWORD},{"pass",HL_KEYWORD},{"break",HL_KEYWORD},{"continue",HL_KEYWORD},{"lambda",HL_KEYWORD},
+    {"global",HL_KEYWORD},{"async",HL_KEYWORD},{"await",HL_KEYWORD},
+    {"None",HL_NUMBER},{"True",HL_NUMBER},{"False",HL_NUMBER},{"self",HL_TYPE},
+    {NULL}
+};
+const HlWord sh_words[] = {
+    {"if",HL_KEYWORD},{"then",HL_KEYWORD},{"else",HL_KEYWORD},{"elif",HL_KEYWORD},{"fi",HL_KEYWORD},
+    {"for",HL_KEYWORD},{"while",HL_KEYWORD},{"do",HL_KEYWORD},{"done",HL_KEYWORD},{"case",HL_KEYWORD},
+    {"esac",HL_KEYWORD},{"in",HL_KEYWORD},{"function",HL_KEYWORD},{"return",HL_KEYWORD},{"local",HL_KEYWORD},
+    {"export",HL_KEYWORD},
+    {NULL}
+};
+const HlWord log_words[] = {
+    {"FATAL",HL_ERROR},{"ERROR",HL_ERROR},{"CRITICAL",HL_ERROR},{"error",HL_ERROR},
+    {"WARN",HL_WARN},{"WARNING",HL_WARN},{"warning",HL_WARN},
+    {"INFO",HL_INFO},{"NOTICE",HL_INFO},{"info",HL_INFO},
+    {"DEBUG",HL_DEBUG},{"TRACE",HL_DEBUG},{"debug",HL_DEBUG},
+    {NULL}
+};
+const Syntax syntaxes[] = {
+    {"c", "c h cc cpp cxx hpp hh", "//", {"/*","*/"}, "\"'", c_words, HLF_NUMBER|HLF_PREPROC},
+    {"json", "json", NULL, {NULL,NULL}, "\"", json_words, HLF_NUMBER|HLF_KEY},
+    {"python", "py", "#", {NULL,NULL}, "\"'", py_words, HLF_NUMBER|HLF_TRIPLE},
+    {"sh", "sh bash", "#", {NULL,NULL}, "\"'", sh_words, HLF_NUMBER},
+    {"log", "log", NULL, {NULL,NULL}, "", log_words, HLF_NUMBER},
+};
+#define SYNTAX_COUNT ((int)(sizeof(syntaxes)/sizeof(syntaxes[0])))
+
+const Syntax *syntax = NULL;        // 当前文档的语法，NULL 为不高亮
+unsigned char *hl_state = NULL;     // 各行行末的扫描状态
+int hl_cap = 0;
+int hl_known = 0;                   // 前 hl_known 行的行末状态已缓存
+int hl_dirty = 0;                   // 从此行起缓存的状态可能过期（等于 hl_known 表示都可信）
+int hl_edit = 0;                    // 过期范围内最后一处改动的行：从这行起新旧状态相同即可停止
+unsigned char *hl_attr = NULL;      // 当前绘制行每个字节的高亮类别
+int hl_attr_cap = 0;
+size_t hl_lexed = 0;                // 累计扫描的行数
+
+// 语法是否有跨行的结构（需要缓存行末状态）
+int hl_multiline(const Syntax *sx) { return sx&&(sx->block[0]||(sx->flags&HLF_TRIPLE)); }
+// 按名称或扩展名查找语法
+const Syntax *syntax_find(const char *name) {
+    for(int i=0;i<SYNTAX_COUNT;i++) {
+        if(!strcmp(name,syntaxes[i].name)) return &syntaxes[i];
+        size_t n=strlen(name);
+        for(const char *e=syntaxes[i].ext;*e;) {
+            size_t k=strcspn(e," ");
+            if(k==n&&!memcmp(e,name,n)) return &syntaxes[i];
+            e+=k; while(*e==' ') e++;
+        }
     }
     return NULL;
 }
+// 按文件扩展名选择语法
+const Syntax *syntax_for(const char *fname) {
+    const char *dot=strrchr(fname,'.'), *slash=strrchr(fname,'/');
+    if(!dot||(slash&&dot<slash)||!dot[1]) return NULL;
+    char ext[16]; size_t i=0;
+    for(dot++;dot[i]&&i<sizeof(ext)-1;i++) ext[i]=(char)(dot[i]>='A'&&dot[i]<='Z'?dot[i]+32:dot[i]);
+    ext[i]=0;
+    return syntax_find(ext);
+}
+// 清空缓存的行末状态（换入新文档或更换语法后）
+void hl_reset() { hl_known=hl_dirty=hl_edit=0; }
+// 切换语法
+void syntax_set(const Syntax *sx) { syntax=sx; hl_reset(); }
 
-// utf8转gbk（windows下中文路径支持）
-int utf8_to_gbk(const char *utf8, char *gbk, int gbk_size) {
-    int wlen = MultiByteToWideChar(CP_UTF8, 0, utf8, -1, NULL, 0);
-    if (wlen <= 0) return 0;
-    wchar_t *wbuf = (wchar_t*)malloc(wlen * sizeof(wchar_t));
-    if (!wbuf) return 0;
-    MultiByteToWideChar(CP_UTF8, 0, utf8, -1, wbuf, wlen);
-    int glen = WideCharToMultiByte(936, 0, wbuf, -1, gbk, gbk_size, NULL, NULL);
-    free(wbuf);
-    return glen;
+int hl_ident(unsigned char c) { return c=='_'||(c|32)-'a'<26u||c-'0'<10u; }
+// s[0,n)中第一次出现pat的位置，没有时返回-1
+int hl_find(const char *s, int n, const char *pat) {
+    int m=(int)strlen(pat);
+    for(const char *p=s,*e=s+n;p+m<=e&&(p=(const char*)memchr(p,pat[0],e-p-m+1));p++)
+        if(!memcmp(p,pat,m)) return (int)(p-s);
+    return -1;
 }
-// 支持utf8文件名的fopen
-FILE *fopen_utf8(const char *fname, const char *mode) {
-    char gbk_fname[512];
-    utf8_to_gbk(fname, gbk_fname, sizeof(gbk_fname));
-    return fopen(gbk_fname, mode);
+// 标识符s[0,n)的类别
+unsigned char hl_word(const Syntax *sx, const char *s, int n) {
+    for(const HlWord *w=sx->words;w->word;w++) if(w->word[0]==s[0]&&!strncmp(w->word,s,n)&&!w->word[n]) return w->cls;
+    return HL_NONE;
 }
-// 保存文件
-void file_save(const char *fname) {
-    FILE *fp = fopen_utf8(fname, "w");
-    if (!fp) { char msg[512]; snprintf(msg,sizeof(msg),"无法打开文件: %s\n",fname); print_utf8(msg); return; }
-    for (int i=0;i<line_count;i++) fprintf(fp,"%s\n",lines[i]);
+// 以状态st开始扫描一行s[0,n)，attr不为NULL时写入每个字节的类别；返回行末状态
+unsigned char hl_lex(const Syntax *sx, const char *s, int n, unsigned char st, unsigned char *attr) {
+    int i=0, lead=1;         // lead：目前只有空白（预处理指令须在行首）
+    if(attr) memset(attr,HL_NONE,n);
+    hl_lexed++;
+    while(i<n) {
+        if(st!=HS_NONE) {    // 接着上一行的块注释或三引号字符串
+            const char *close=st==HS_BLOCK?sx->block[1]:st==HS_TRIPLE_DQ?"\"\"\"":"'''";
+            int k=hl_find(s+i,n-i,close), j=k<0?n:i+k+(int)strlen(close);
+            if(attr) memset(attr+i,st==HS_BLOCK?HL_COMMENT:HL_STRING,j-i);
+            if(k>=0) st=HS_NONE;
+            i=j; lead=0; continue;
+        }
+        unsigned char c=(unsigned char)s[i];
+        if(c==' '||c=='\t') { i++; continue; }
+        if(sx->comment&&c==(unsigned char)sx->comment[0]&&!strncmp(s+i,sx->comment,strlen(sx->comment))&&(c!='#'||lead||s[i-1]==' '||s[i-1]=='\t')) {
+            if(attr) memset(attr+i,HL_COMMENT,n-i);
+            break;
+        }
+        if(sx->block[0]&&c==(unsigned char)sx->block[0][0]&&!strncmp(s+i,sx->block[0],strlen(sx->block[0]))) {
+            int k=(int)strlen(sx->block[0]);
+            if(attr) memset(attr+i,HL_COMMENT,k);
+            i+=k; st=HS_BLOCK; continue;
+        }
+        if((sx->flags&HLF_TRIPLE)&&(c=='"'||c=='\'')&&i+2<n&&s[i+1]==c&&s[i+2]==c) {
+            if(attr) memset(attr+i,HL_STRING,3);
+            i+=3; st=c=='"'?HS_TRIPLE_DQ:HS_TRIPLE_SQ; continue;
+        }
+        lead=lead&&c=='#'&&(sx->flags&HLF_PREPROC);
+        if(lead) {           // #include 等预处理指令名
+            int j=i+1;
+            while(j<n&&(s[j]==' '||s[j]=='\t')) j++;
+            while(j<n&&hl_ident((unsigned char)s[j])) j++;
+            if(attr) memset(attr+i,HL_PREPROC,j-i);
+            i=j; lead=0; continue;
+        }
+        if(c&&strchr(sx->quotes,c)) {  // 字符串不跨行，未闭合的到行末为止
+            int j=i+1;
+            while(j<n&&s[j]!=(char)c) j+=s[j]=='\\'?2:1;
+            j=j<n?j+1:n;
+            unsigned char cls=HL_STRING;
+            if(sx->flags&HLF_KEY) { int k=j; while(k<n&&(s[k]==' '||s[k]=='\t')) k++; if(k<n&&s[k]==':') cls=HL_KEY; }
+            if(attr) memset(attr+i,cls,j-i);
+            i=j; continue;
+        }
+        if(hl_ident(c)) {
+            int j=i+1;
+            if(c-'0'<10u&&(sx->flags&HLF_NUMBER)) {
+                while(j<n&&(hl_ident((unsigned char)s[j])||s[j]=='.')) j++;
+                if(attr) memset(attr+i,HL_NUMBER,j-i);
+            } else {
+                while(j<n&&hl_ident((unsigned char)s[j])) j++;
+                unsigned char cls=c-'0'<10u?HL_NONE:hl_word(sx,s+i,j-i);
+                if(attr&&cls) memset(attr+i,cls,j-i);
+            }
+            i=j; continue;
+        }
+        i++;
+    }
+    return st;
+}
+// 确保前 upto 行的行末状态可信：从 hl_dirty 起重扫，过了最后一处改动后新旧状态相同即跳到缓存末尾继续；
+// 未收敛就停在 upto 时，已改写的行不能再作收敛比较，把 hl_edit 推到停下的行
+void hl_sync(int upto) {
+    if(!hl_multiline(syntax)) return;
+    if(upto>line_count) upto=line_count;
+    int i=hl_dirty;
+    unsigned char st=i?hl_state[i-1]:HS_NONE;
+    while(i<upto) {
+        const char *s=line_get(i);
+        unsigned char ns=hl_lex(syntax,s,(int)strlen(s),st,NULL);
+        if(i<hl_known) {
+            int same=hl_state[i]==ns;
+            hl_state[i]=ns;
+            if(same&&i>=hl_edit) { i=hl_known; st=hl_state[i-1]; continue; }
+        } else {
+            if(i>=hl_cap) { hl_cap=hl_cap?hl_cap*2:4096; hl_state=(unsigned char*)realloc(hl_state,hl_cap); }
+            hl_state[i]=ns; hl_known=i+1;
+        }
+        st=ns; i++;
+    }
+    if(i<hl_known&&hl_edit<i) hl_edit=i;
+    hl_dirty=i;
+}
+// 第i行（内容s，n字节）每个字节的高亮类别；不高亮时返回NULL。需先 hl_sync 到第i行
+const unsigned char *hl_line(int i, const char *s, int n) {
+    if(!syntax) return NULL;
+    if(n+1>hl_attr_cap) { hl_attr_cap=n+1; hl_attr=(unsigned char*)realloc(hl_attr,hl_attr_cap); }
+    unsigned char st=hl_multiline(syntax)&&i>0&&i<=hl_dirty?hl_state[i-1]:HS_NONE;
+    hl_lex(syntax,s,n,st,hl_attr);
+    hl_attr[n]=HL_NONE;
+    return hl_attr;
+}
+// 编辑后平移缓存的行末状态：first行起的removed+1行改写为added+1行
+void hl_lines_edit(int first, int removed, int added) {
+    if(!hl_multiline(syntax)) return;
+    if(hl_dirty==hl_known) hl_edit=first+added;  // 此前都可信：改动范围只有这一处
+    else { if(hl_edit>first+removed) hl_edit+=added-removed; if(hl_edit<first+added) hl_edit=first+added; }
+    if(hl_known>first+removed) {  // 原最后一个改动行的状态移到新的最后一个改动行，供收敛比较
+        int n=hl_known+added-removed;
+        if(n>hl_cap) { while(n>hl_cap) hl_cap*=2; hl_state=(unsigned char*)realloc(hl_state,hl_cap); }
+        if(added!=removed) memmove(hl_state+first+added,hl_state+first+removed,hl_known-first-removed);
+        hl_known=n;
+    } else if(hl_known>first) hl_known=first;
+    if(hl_dirty>first) hl_dirty=first;
+    if(hl_dirty>hl_known) hl_dirty=hl_known;
+}
+
+// ------------- 交换日志 -------------
+// 打开的文件旁有一个只追加的交换日志“文件名.swp”：头部记下基准文档长度，之后每次插入/删除追加一条记录。
+// 记录先进内存缓冲，每批输入处理完写出一次，间隔 SWAP_SYNC_NS 以上才落盘；保存后以新文件为基准重写，
+// 正常退出时删除。进程被杀后交换日志留下，用 -r 启动时在原文件上重放即可恢复。
+// 格式：“ONESWAP1” + 8字节基准长度；记录 = 'I'/'D' + 8字节偏移 + 8字节长度 [+ 插入的内容]，整数均为小端。
+
+FILE *swap_fp = NULL;               // 交换日志（未启用时为NULL）
+char swap_name[264] = "";           // 交换日志文件名
+char *swap_buf = NULL;              // 尚未写出的记录
+size_t swap_len = 0, swap_cap = 0;
+unsigned long long swap_synced = 0; // 上次落盘时刻
+int opt_recover = 0;                // 以 -r 启动：打开文件后从交换日志恢复
+size_t swap_grow = 0;               // :follow 接上文件新增内容后日志应改用的基准（0 为不需要），下一条记录前改写
+
+void swap_put(const void *p, size_t n) {
+    if(swap_len+n>swap_cap) {
+        while(swap_len+n>swap_cap) swap_cap=swap_cap?swap_cap*2:4096;
+        swap_buf=(char*)realloc(swap_buf,swap_cap);
+    }
+    memcpy(swap_buf+swap_len,p,n); swap_len+=n;
+}
+void swap_put_u64(unsigned long long v) {
+    unsigned char b[8];
+    for(int i=0;i<8;i++) b[i]=(unsigned char)(v>>(8*i));
+    swap_put(b,8);
+}
+unsigned long long swap_get_u64(const unsigned char *b) {
+    unsigned long long v=0;
+    for(int i=7;i>=0;i--) v=v<<8|b[i];
+    return v;
+}
+// 写出缓冲的记录；sync 为真或距上次落盘已超过间隔时落盘
+void swap_flush(int sync) {
+    if(!swap_fp) return;
+    if(swap_len) { fwrite(swap_buf,1,swap_len,swap_fp); swap_len=0; fflush(swap_fp); }
+    unsigned long long t=now_ns();
+    if(sync||t-swap_synced>=SWAP_SYNC_NS) { file_sync(swap_fp); swap_synced=t; }
+}
+void swap_rebase(size_t base, long mark);
+// 记录一次插入（s为内容）或删除
+void swap_record(int del, size_t off, const char *s, size_t n) {
+    if(!swap_fp) return;
+    if(swap_grow) { size_t base=swap_grow; swap_grow=0; swap_rebase(base,16); }
+    char op=del?'D':'I';
+    swap_put(&op,1); swap_put_u64(off); swap_put_u64(n);
+    if(!del) swap_put(s,n);
+    if(swap_len>=SWAP_BUF_MAX) swap_flush(0);
+}
+// 关闭交换日志，keep 为0时删除文件
+void swap_close(int keep) {
+    swap_grow=0;
+    if(!swap_fp) return;
+    swap_flush(1); fclose(swap_fp); swap_fp=NULL; swap_len=0;
+    if(!keep) remove_utf8(swap_name);
+}
+// 正常退出时删除交换日志
+void swap_exit() { swap_close(0); }
+// 以当前文档为基准为fname新建交换日志
+void swap_open(const char *fname) {
+    swap_close(0);
+    snprintf(swap_name,sizeof(swap_name),"%s.swp",fname);
+    swap_fp=fopen_utf8(swap_name,"wb");
+    if(!swap_fp) return;
+    swap_put("ONESWAP1",8); swap_put_u64(pt_length());
+    swap_flush(1);
+}
+// 保存完成后以保存的内容（长度base）为基准重写交换日志，保留保存开始后（日志偏移mark起）的记录；
+// 新日志先写入临时文件再替换，任何时刻磁盘上都有一份完整的日志
+void swap_rebase(size_t base, long mark) {
+    if(!swap_fp) return;
+    swap_grow=0;
+    swap_flush(0);
+    FILE *in=fopen_utf8(swap_name,"rb");
+    if(!in) return;
+    char *d=NULL; size_t len=0, cap=0, k;
+    fseek(in,mark,SEEK_SET);
+    do {
+        if(len==cap) { cap=cap?cap*2:65536; d=(char*)realloc(d,cap); }
+        k=fread(d+len,1,cap-len,in); len+=k;
+    } while(k);
+    fclose(in);
+    char tmp[272]; snprintf(tmp,sizeof(tmp),"%s.new",swap_name);
+    FILE *out=fopen_utf8(tmp,"wb");
+    if(out) {
+        FILE *old=swap_fp; swap_fp=out;
+        swap_put("ONESWAP1",8); swap_put_u64(base); swap_put(d,len);
+        swap_flush(1); fclose(out); swap_fp=old;
+        if(file_replace(tmp,swap_name)) { fclose(swap_fp); swap_fp=fopen_utf8(swap_name,"ab"); }
+        else remove_utf8(tmp);
+    }
+    free(d);
+}
+// fname 是否留有交换日志
+int swap_exists(const char *fname) {
+    char name[264]; snprintf(name,sizeof(name),"%s.swp",fname);
+    FILE *fp=fopen_utf8(name,"rb");
+    if(fp) fclose(fp);
+    return fp!=NULL;
+}
+// 打开文件后启用交换日志；已有交换日志时保留它不动，提示用 -r 恢复，直到保存后才重新记录
+void swap_start(const char *fname) {
+    swap_close(0);
+    if(swap_exists(fname)) {
+        if(opt_recover) return;
+        char msg[640]; snprintf(msg,sizeof(msg),"发现交换文件 %s.swp，上次编辑可能未正常退出。\n用 -r 启动可恢复；本次保存前不记录交换日志。按任意键继续\n",fname);
+        print_utf8(msg); term_getkey(); return;
+    }
+    swap_open(fname);
+}
+void buf_insert(size_t off, const char *s, size_t n);
+void buf_delete(size_t off, size_t n);
+void undo_close();
+// 在刚打开的 fname 上重放其交换日志，之后继续追加；返回重放的记录数，日志无效或与文件不符时返回-1。
+// 末尾写了一半的记录丢弃；重放的编辑合为一个撤销组
+void load_finish();
+long swap_recover(const char *fname) {
+    load_finish();
+    char name[264]; snprintf(name,sizeof(name),"%s.swp",fname);
+    FILE *fp=fopen_utf8(name,"rb");
+    if(!fp) return -1;
+    unsigned char *d=NULL; size_t len=0, cap=0, k;
+    do {
+        if(len==cap) { cap=cap?cap*2:65536; d=(unsigned char*)realloc(d,cap); }
+        k=fread(d+len,1,cap-len,fp); len+=k;
+    } while(k);
     fclose(fp);
+    if(len<16||memcmp(d,"ONESWAP1",8)||swap_get_u64(d+8)!=pt_length()) { free(d); return -1; }
+    size_t p=16; long count=0;
+    while(p+17<=len) {
+        unsigned long long off=swap_get_u64(d+p+1), n=swap_get_u64(d+p+9);
+        int del=d[p]=='D';
+        if((d[p]!='I'&&!del)||off>pt_length()||(del&&n>pt_length()-off)||(!del&&n>len-p-17)) break;
+        if(del) buf_delete((size_t)off,(size_t)n); else buf_insert((size_t)off,(const char*)d+p+17,(size_t)n);
+        p+=17+(del?0:(size_t)n); count++;
+    }
+    undo_close();
+    snprintf(swap_name,sizeof(swap_name),"%s",name);
+    swap_fp=fopen_utf8(swap_name,"wb");
+    if(swap_fp) { fwrite(d,1,p,swap_fp); swap_flush(1); }
+    free(d);
+    return count;
+}
+
+// 在偏移off处插入文本
+void buf_insert(size_t off, const char *s, size_t n) {
+    if(!n) return;
+    if(!undo_replaying) { char *t=(char*)pool_alloc(&undo_pool,n); memcpy(t,s,n); undo_record(0,off,t,n); }
+    swap_record(0,off,s,n);
+    int first=(int)pt_line_of(off);
+    pt_insert(off,s,n); buf_changed();
+    int added=count_nl(s,n);
+    line_cache_edit(first,0,added); match_index_edit(first,0,added); hl_lines_edit(first,0,added);
+}
+// 删除偏移off起的n字节
+void buf_delete(size_t off, size_t n) {
+    if(!n) return;
+    char *t=(char*)pool_alloc(&undo_pool,n); pt_read(off,n,t);
+    int first=(int)pt_line_of(off), removed=count_nl(t,n);
+    if(!undo_replaying) undo_record(1,off,t,n); else pool_free(&undo_pool,t,n);
+    swap_record(1,off,NULL,n);
+    pt_delete(off,n); buf_changed();
+    line_cache_edit(first,removed,0); match_index_edit(first,removed,0); hl_lines_edit(first,removed,0);
+}
+// 删除第y行指定可见宽度位置的字形簇
+void delvis(int y, int vis) {
+    const char *s=line_get(y);
+    int pos=line_vis2real(y,vis);
+    if(!s[pos]) return;
+    buf_delete(line_off(y)+pos,cluster_len(s,pos));
+}
+// 在第y行指定可见宽度位置插入字符，返回插入内容之后的列（组合符号并入前一字形簇时列不变）
+int insvis(int y, int vis, const char *ins, int inslen) {
+    int pos=line_vis2real(y,vis);
+    buf_insert(line_off(y)+pos,ins,inslen);
+    return line_real2vis(y,pos+inslen);
+}
+
+void undo_clear();
+void load_cancel();
+int save_finish(int wait);
+// 换入新文档后复位编辑状态：清空撤销并复位光标
+void doc_reset() {
+    undo_clear(); buf_changed(); line_cache_reset(); hl_reset(); match_valid=0;
+    saved_gen=edit_gen;
+    cx=cy=0; scroll=hscroll=0;
+}
+// 用data[start,size)（接管整个data）替换整个文档：去掉末尾换行，清空撤销并复位光标
+void doc_replace_at(char *data, size_t size, size_t start, int mapped) {
+    size_t len=size-start;
+    if(len&&data[size-1]=='\n') len--;
+    save_finish(1); load_cancel();
+    pt_load(data,size,start,len,mapped); doc_reset();
+}
+// 用data（接管所有权）替换整个文档
+void doc_replace(char *data, size_t size, int mapped) { doc_replace_at(data,size,0,mapped); }
+
+// ------------- 文件编码 -------------
+// 文档内部一律为UTF-8、换行为 \n。打开时从 BOM 与抽样内容判断编码：合法UTF-8（含纯ASCII）且不需归一化的文件直接映射，
+// 不复制；GBK、UTF-16 与需要归一化的 \r\n 文件按段转码到原始缓冲。保存时按原来的编码、BOM 与换行写回。
+
+const char *enc_names[] = { "UTF-8", "GBK", "UTF-16LE", "UTF-16BE" };
+
+// 解析 :set enc= 的编码名（不区分大小写，utf-8-bom 为带 BOM 的UTF-8），*bom 为写出时是否带 BOM；不认识时返回-1
+int enc_parse(const char *v, int *bom) {
+    char low[16]; size_t i=0;
+    for(;v[i]&&i<sizeof(low)-1;i++) low[i]=(char)(v[i]>='A'&&v[i]<='Z'?v[i]+32:v[i]);
+    low[i]=0;
+    const char *names[]={ "utf-8", "gbk", "utf-16le", "utf-16be", "utf-8-bom", "utf8", "cp936" };
+    const int enc[]={ ENC_UTF8, ENC_GBK, ENC_UTF16LE, ENC_UTF16BE, ENC_UTF8, ENC_UTF8, ENC_GBK };
+    for(int k=0;k<7;k++) if(!strcmp(low,names[k])) { *bom=k==4||enc[k]==ENC_UTF16LE||enc[k]==ENC_UTF16BE; return enc[k]; }
+    return -1;
+}
+
+// p[0,n)是否为合法UTF-8：head 为真时跳过开头不完整的字符，tail 为真时允许末尾的字符不完整。
+// 纯ASCII的部分每次用SSE2检查16字节
+int utf8_valid(const unsigned char *p, size_t n, int head, int tail) {
+    size_t i=0;
+    if(head) while(i<n&&i<3&&(p[i]&0xC0)==0x80) i++;
+    while(i<n) {
+#if defined(__SSE2__)
+        while(i+16<=n&&!_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(p+i)))) i+=16;
+        if(i>=n) break;
+#endif
+        unsigned c=p[i];
+        if(c<0x80) { i++; continue; }
+        int k=c>=0xC2&&c<=0xDF?1:c>=0xE0&&c<=0xEF?2:c>=0xF0&&c<=0xF4?3:-1;
+        if(k<0) return 0;
+        unsigned lo=c==0xE0?0xA0:c==0xF0?0x90:0x80, hi=c==0xED?0x9F:c==0xF4?0x8F:0xBF;  // 排除过长编码与代理区
+        for(int j=1;j<=k;j++) {
+            if(i+j>=n) return tail;
+            unsigned d=p[i+j];
+            if(d<(j==1?lo:0x80)||d>(j==1?hi:0xBF)) return 0;
+        }
+        i+=k+1;
+    }
+    return 1;
+}
+// p[0,n)是否符合GBK的双字节结构（首字节 0x81-0xFE，次字节 0x40-0xFE 且不为 0x7F）；head 为真时从第一个ASCII字节之后开始
+int gbk_like(const unsigned char *p, size_t n, int head) {
+    size_t i=0;
+    if(head) { while(i<n&&p[i]>=0x80) i++; }
+    while(i<n) {
+        if(p[i]<0x80) { i++; continue; }
+        if(p[i]==0x80||p[i]==0xFF) return 0;
+        if(i+1<n&&(p[i+1]<0x40||p[i+1]==0x7F||p[i+1]==0xFF)) return 0;
+        i+=2;
+    }
+    return 1;
+}
+// 判断文件内容的编码，*bom 为开头 BOM 的字节数：有 BOM 按 BOM；开头一段只在奇（偶）数位置出现0字节的为无 BOM 的 UTF-16；
+// 否则检查UTF-8合法性（大文件只查均匀分布的 ENC_WINDOWS 个窗口），不合法的窗口都像GBK时按GBK，其余按UTF-8
+int text_detect(const char *data, size_t n, size_t *bom) {
+    const unsigned char *p=(const unsigned char*)data;
+    *bom=0;
+    if(n>=3&&p[0]==0xEF&&p[1]==0xBB&&p[2]==0xBF) { *bom=3; return ENC_UTF8; }
+    if(n>=2&&p[0]==0xFF&&p[1]==0xFE) { *bom=2; return ENC_UTF16LE; }
+    if(n>=2&&p[0]==0xFE&&p[1]==0xFF) { *bom=2; return ENC_UTF16BE; }
+    size_t m=n<ENC_SAMPLE?n:ENC_SAMPLE, z[2]={0,0};
+    for(size_t i=0;i<m;i++) if(!p[i]) z[i&1]++;
+    if(z[1]>m/8&&!z[0]) return ENC_UTF16LE;
+    if(z[0]>m/8&&!z[1]) return ENC_UTF16BE;
+    size_t win=n<=(size_t)ENC_SAMPLE*ENC_WINDOWS?n:ENC_SAMPLE, count=win==n?1:ENC_WINDOWS;
+    int gbk=0;
+    for(size_t w=0;w<count;w++) {
+        size_t a=count==1?0:(n-win)/(count-1)*w, b=a+win;
+        if(utf8_valid(p+a,win,a>0,b<n)) continue;
+        if(!gbk_like(p+a,win,a>0)) return ENC_UTF8;
+        gbk=1;
+    }
+    return gbk?ENC_GBK:ENC_UTF8;
+}
+// 从 bom 之后的第一个换行判断换行风格：1 为 \r\n，0 为 \n，-1 为没有换行
+int text_crlf(int enc, const char *data, size_t n, size_t bom) {
+    if(enc==ENC_UTF16LE||enc==ENC_UTF16BE) {
+        int be=enc==ENC_UTF16BE;
+        for(size_t i=bom;i+1<n;i+=2)
+            if(data[i+be]=='\n'&&!data[i+!be]) return i>=bom+2&&data[i-2+be]=='\r'&&!data[i-2+!be];
+        return -1;
+    }
+    const char *first=n>bom?(const char*)memchr(data+bom,'\n',n-bom):NULL;
+    return first?first>data+bom&&first[-1]=='\r':-1;
+}
+// 转码 n 字节最多需要的输出空间
+size_t text_decode_max(int enc, size_t n) { return enc==ENC_UTF8?n:n*3+4; }
+// 把按 enc 编码的 in[0,n) 转为UTF-8写入 out（无效的字符转为 U+FFFD），返回写出的字节数，*used 为读入的字节数；
+// last 为假时末尾不完整的字符留给下一段
+size_t text_decode(int enc, const char *in, size_t n, char *out, size_t *used, int last) {
+    if(enc==ENC_UTF8) { memcpy(out,in,n); *used=n; return n; }
+    if(enc==ENC_GBK) return gbk_decode(in,n,out,used,last);
+    const unsigned char *p=(const unsigned char*)in;
+    int be=enc==ENC_UTF16BE;
+    size_t i=0, w=0;
+    while(i+2<=n) {
+        unsigned c=be?(p[i]<<8|p[i+1]):(p[i+1]<<8|p[i]);
+        if(c<0x80) { out[w++]=(char)c; i+=2; continue; }
+        if(c>=0xD800&&c<0xDC00) {
+            if(i+4>n&&!last) break;
+            unsigned d=i+4<=n?(be?(p[i+2]<<8|p[i+3]):(p[i+3]<<8|p[i+2])):0;
+            if(d>=0xDC00&&d<0xE000) { c=0x10000+((c-0xD800)<<10)+(d-0xDC00); i+=2; }
+            else c=0xFFFD;
+        } else if(c>=0xDC00&&c<0xE000) c=0xFFFD;
+        w+=utf8_encode((int)c,out+w); i+=2;
+    }
+    if(last&&i<n) { w+=utf8_encode(0xFFFD,out+w); i=n; }
+    *used=i;
+    return w;
+}
+// 把 buf[from,to) 中的 \r\n 就地改为 \n（crlf 为真时），nl 不为NULL时记录其中的换行位置；返回新的结束位置
+size_t text_lf(char *buf, size_t from, size_t to, int crlf, NlScanJob *nl) {
+    if(nl) { nl->cap=(to-from)/64+16; nl->nl=(size_t*)malloc(nl->cap*sizeof(size_t)); nl->count=0; }
+    const char *p=buf+from, *e=buf+to;
+    size_t w=from;
+    while(p<e) {
+        const char *q=(const char*)memchr(p,'\n',e-p);
+        size_t k=(q?q:e)-p;
+        if(crlf&&q&&k&&q[-1]=='\r') k--;
+        if(buf+w!=p) memmove(buf+w,p,k);
+        w+=k;
+        if(!q) break;
+        if(nl) {
+            if(nl->count==nl->cap) { nl->cap*=2; nl->nl=(size_t*)realloc(nl->nl,nl->cap*sizeof(size_t)); }
+            nl->nl[nl->count++]=w;
+        }
+        buf[w++]='\n'; p=q+1;
+    }
+    return w;
+}
+// 转码 in[0,n) 接到 buf 的 at 处并归一化换行，返回新的结束位置，*used 为读入的字节数；
+// last 为假时末尾不完整的字符与单独的 \r 都留给下一段（\r 可能与下一段开头的 \n 组成 \r\n）
+size_t text_convert(int enc, int crlf, const char *in, size_t n, char *buf, size_t at, size_t *used, int last, NlScanJob *nl) {
+    size_t k=text_decode(enc,in,n,buf+at,used,last);
+    if(crlf&&!last&&k&&buf[at+k-1]=='\r') { k--; *used-=enc==ENC_UTF16LE||enc==ENC_UTF16BE?2:1; }
+    return text_lf(buf,at,at+k,crlf,nl);
+}
+// 把UTF-8的 in[0,n) 转为 enc 编码写入 out（至少 2n+4 字节），返回写出的字节数，*used 为读入的字节数；
+// last 为假时末尾不完整的字符留给下一段
+size_t text_encode(int enc, const char *in, size_t n, char *out, size_t *used, int last) {
+    if(enc==ENC_GBK) return gbk_encode(in,n,out,used,last);
+    size_t i=0, w=0, end=last?n:utf8_complete(in,n);
+    int be=enc==ENC_UTF16BE;
+    while(i<end) {
+        int cp; i+=utf8_decode_n(in+i,end-i,&cp);
+        unsigned u[2]; int k=1;
+        if(cp>=0x10000) { u[0]=0xD800+((cp-0x10000)>>10); u[1]=0xDC00+((cp-0x10000)&0x3FF); k=2; }
+        else u[0]=(unsigned)cp;
+        for(int j=0;j<k;j++) { out[w+be]=(char)(u[j]&0xFF); out[w+!be]=(char)(u[j]>>8); w+=2; }
+    }
+    *used=i;
+    return w;
+}
+// 按文档的编码、BOM 与换行写文件：\n 写成 \r\n，再转回原编码；写入的片段可能在字符中间断开，不完整的字节留到下一次
+typedef struct {
+    FILE *fp;
+    int enc, crlf;
+    char carry[4]; size_t ncarry;
+    char *in, *out;          // 换行展开后 / 转码后的一段
+} TextWriter;
+// 开始写，先写出 BOM；返回非0表示出错
+int text_writer_begin(TextWriter *w, FILE *fp, int enc, int crlf, int bom) {
+    w->fp=fp; w->enc=enc; w->crlf=crlf; w->ncarry=0; w->in=w->out=NULL;
+    if(!bom) return 0;
+    const char *mark=enc==ENC_UTF16LE?"\xFF\xFE":enc==ENC_UTF16BE?"\xFE\xFF":"\xEF\xBB\xBF";
+    size_t k=enc==ENC_UTF8?3:2;
+    return enc!=ENC_GBK&&fwrite(mark,1,k,fp)!=k;
+}
+// 写一段UTF-8文本；返回非0表示出错
+int text_write(TextWriter *w, const char *p, size_t n, int last) {
+    if(w->enc==ENC_UTF8&&!w->crlf) return fwrite(p,1,n,w->fp)!=n;
+    if(!w->in) { w->in=(char*)malloc(2*TEXT_WRITE_SEG+8); w->out=(char*)malloc(4*TEXT_WRITE_SEG+24); }
+    do {
+        size_t k=n<TEXT_WRITE_SEG?n:TEXT_WRITE_SEG, len=w->ncarry, used;
+        memcpy(w->in,w->carry,w->ncarry);
+        for(size_t i=0;i<k;i++) { if(w->crlf&&p[i]=='\n') w->in[len++]='\r'; w->in[len++]=p[i]; }
+        p+=k; n-=k;
+        if(w->enc==ENC_UTF8) { w->ncarry=0; if(fwrite(w->in,1,len,w->fp)!=len) return 1; continue; }
+        size_t m=text_encode(w->enc,w->in,len,w->out,&used,last&&!n);
+        w->ncarry=len-used; memcpy(w->carry,w->in+used,w->ncarry);
+        if(fwrite(w->out,1,m,w->fp)!=m) return 1;
+    } while(n);
+    return 0;
+}
+// 写完（last 为真的 text_write 之后）释放缓冲
+void text_writer_end(TextWriter *w) { free(w->in); free(w->out); w->in=w->out=NULL; }
+// 片段写入文件的访问器
+int file_write_visit(const char *p, size_t n, size_t off, void *ctx) {
+    return text_write((TextWriter*)ctx,p,n,0);
+}
+// 小文件整段转码：返回新分配的UTF-8缓冲，*len 为其长度
+char *text_decode_all(int enc, int crlf, const char *in, size_t n, size_t *len) {
+    char *out=(char*)malloc(text_decode_max(enc,n)+1); size_t used;
+    *len=text_convert(enc,crlf,in,n,out,0,&used,1,NULL);
+    return (char*)realloc(out,*len?*len:1);
+}
+
+// ------------- 渐进式打开 -------------
+// 大文件由后台线程按 LOAD_CHUNK 分块扫描换行（需要时同时转码、把 \r\n 归一化到新缓冲），每块完成即发布；
+// 主线程按顺序取走已完成的块，把到最后一个换行为止的内容作为原始缓冲片段接到文档末尾。
+// 用户的编辑只会落在已加载部分，之后接上的内容总在文档最后，因此撤销记录与交换日志的偏移都不受影响。
+// 只读查看（-R）时原始缓冲只记每 NL_SPARSE_STEP 个换行的位置，扫描过的页随即交还系统，内存占用与文件大小基本无关。
+
+// 一个分块：扫描结果与完成标志（原子读写）
+typedef struct {
+    NlScanJob scan;          // 换行位置（原始缓冲中的偏移）
+    size_t out_end;          // 本块结束处在原始缓冲中的偏移
+    int ready;
+} LoadChunk;
+typedef struct {
+    int active;              // 正在加载
+    const char *in;          // 映射的文件内容
+    size_t in_size;
+    char *out;               // 原始缓冲的数据（不需转码时即 in）
+    int copy;                // 需要转码或归一化到 orig_buf.data
+    int enc, crlf;           // 文件编码 / 是否把 \r\n 归一化为 \n
+    size_t bom;              // 开头 BOM 的字节数
+    LoadChunk *chunk;
+    size_t nchunks, taken;   // 分块数 / 主线程已取走的块数
+    size_t doc_end;          // 已接入文档的原始缓冲字节数
+    size_t nl_seen, last_nl; // 已取走的换行数 / 其中最后一个换行的位置
+    int nthreads, cancel;    // 扫描线程数 / 要求线程提前结束（原子读写）
+    thread_t th[NL_SCAN_MAX_THREADS];
+    int started[NL_SCAN_MAX_THREADS];
+} Loader;
+Loader loader;
+
+// 扫描线程：不需转码时各线程隔块并行扫描；需要转码时只有一个线程顺序写出，
+// 块尾不完整的字符与单独的 \r 留给下一块
+void load_worker(void *arg) {
+    int id=(int)(size_t)arg;
+    size_t w=0, pos=loader.bom;
+    for(size_t i=id;i<loader.nchunks;i+=loader.nthreads) {
+        if(__atomic_load_n(&loader.cancel,__ATOMIC_RELAXED)) return;
+        LoadChunk *c=&loader.chunk[i];
+        size_t b=i*(size_t)LOAD_CHUNK, e=b+LOAD_CHUNK<loader.in_size?b+LOAD_CHUNK:loader.in_size;
+        if(!loader.copy) {
+            c->scan.data=loader.in; c->scan.begin=b; c->scan.end=e;
+            nl_scan_worker(&c->scan); c->out_end=e;
+        } else {
+            size_t used;
+            w=text_convert(loader.enc,loader.crlf,loader.in+pos,e-pos,loader.out,w,&used,e==loader.in_size,&c->scan);
+            pos+=used; c->out_end=w;
+        }
+        if(view_mode) file_drop(loader.in+b,e-b);  // 只读查看：扫描过的页不常驻
+        __atomic_store_n(&c->ready,1,__ATOMIC_RELEASE);
+    }
+}
+// 把原始缓冲[from,to)接到文档末尾
+void doc_append_orig(size_t from, size_t to) {
+    int first=line_count-1, clean=edit_gen==saved_gen;
+    size_t lf=buf_lf(BUF_ORIG,from,to-from);
+    Piece *last=pt_root;
+    while(last&&last->r) last=last->r;
+    if(last&&last->buf==BUF_ORIG&&last->start+last->len==from) pt_root=pt_grow_last(pt_root,to-from,lf);
+    else pt_root=pt_merge(pt_root,piece_new(BUF_ORIG,from,to-from));
+    buf_changed();
+    line_cache_edit(first,0,(int)lf); match_index_edit(first,0,(int)lf); hl_lines_edit(first,0,(int)lf);
+    if(clean) saved_gen=edit_gen;
+}
+// 停止后台线程并释放分块
+void load_stop() {
+    __atomic_store_n(&loader.cancel,1,__ATOMIC_RELAXED);
+    for(int i=0;i<loader.nthreads;i++) if(loader.started[i]) thread_join(loader.th[i]);
+    for(size_t i=loader.taken;i<loader.nchunks;i++) free(loader.chunk[i].scan.nl);
+    free(loader.chunk);
+    if(loader.copy&&loader.in) file_unmap((char*)loader.in,loader.in_size);
+    memset(&loader,0,sizeof(loader));
+}
+// 放弃正在进行的加载（换入其它文档前）
+void load_cancel() { if(loader.active) load_stop(); }
+// 取走已完成的分块并接入文档；返回文档是否有变化
+int load_poll() {
+    if(!loader.active) return 0;
+    size_t from=loader.taken;
+    while(loader.taken<loader.nchunks&&__atomic_load_n(&loader.chunk[loader.taken].ready,__ATOMIC_ACQUIRE)) {
+        LoadChunk *c=&loader.chunk[loader.taken++];
+        TextBuf *b=&orig_buf;
+        if(b->nl_step) {  // 稀疏索引只留下检查点
+            for(size_t k=b->nl_step-1-loader.nl_seen%b->nl_step;k<c->scan.count;k+=b->nl_step) textbuf_add_nl(b,c->scan.nl[k]);
+        } else {
+            if(b->nl_count+c->scan.count>b->nl_cap) {
+                while(b->nl_count+c->scan.count>b->nl_cap) b->nl_cap=b->nl_cap?b->nl_cap*2:4096;
+                b->nl=(size_t*)realloc(b->nl,b->nl_cap*sizeof(size_t));
+            }
+            memcpy(b->nl+b->nl_count,c->scan.nl,c->scan.count*sizeof(size_t));
+            b->nl_count+=c->scan.count;
+        }
+        if(c->scan.count) loader.last_nl=c->scan.nl[c->scan.count-1];
+        loader.nl_seen+=c->scan.count; free(c->scan.nl);
+        if(loader.copy) b->len=c->out_end;
+    }
+    if(loader.taken==from) return 0;
+    size_t end;
+    int done=loader.taken==loader.nchunks;
+    if(done) {
+        size_t total=loader.chunk[loader.nchunks-1].out_end;
+        end=total&&orig_buf.data[total-1]=='\n'?total-1:total;
+        if(loader.copy&&total) orig_buf.data=(char*)realloc(orig_buf.data,total);  // 转码缓冲按最坏情况分配，收回多余部分
+        orig_buf.len=orig_buf.cap=total;
+        loader.taken=loader.nchunks;
+    } else end=loader.nl_seen?loader.last_nl:0;
+    if(end>loader.doc_end) { doc_append_orig(loader.doc_end,end); loader.doc_end=end; }
+    if(done) {
+        load_stop();
+        if(swap_fp) swap_rebase(end,16);  // 交换日志的基准改为完整文件的长度
+    }
+    return 1;
+}
+// 等到加载完成
+void load_finish() { while(loader.active) { if(!load_poll()) sleep_ms(1); } }
+// 等到至少加载了n行（或加载完成）
+void load_wait_lines(int n) { while(loader.active&&line_count<n) { if(!load_poll()) sleep_ms(1); } }
+// 开始在后台加载映射的文件内容；文档先置为空，随分块完成逐步接上
+void load_start(char *data, size_t size, int enc, int crlf, size_t bom) {
+    save_finish(1); load_cancel();
+    pool_reset(&piece_pool); pt_root=NULL;
+    textbuf_free(&orig_buf); textbuf_free(&add_buf);
+    if(view_mode) orig_buf.nl_step=NL_SPARSE_STEP;
+    loader.in=data; loader.in_size=size; loader.enc=enc; loader.crlf=crlf; loader.bom=bom;
+    loader.copy=crlf||enc!=ENC_UTF8;
+    if(loader.copy) { orig_buf.cap=text_decode_max(enc,size); orig_buf.data=(char*)malloc(orig_buf.cap); }
+    else { orig_buf.data=data; orig_buf.len=orig_buf.cap=size; orig_buf.mapped=1; loader.doc_end=bom; }
+    loader.out=orig_buf.data;
+    loader.nchunks=(size+LOAD_CHUNK-1)/LOAD_CHUNK;
+    loader.chunk=(LoadChunk*)calloc(loader.nchunks,sizeof(LoadChunk));
+    int n=loader.copy?1:cpu_count();
+    if(n<1) n=1;
+    if(n>NL_SCAN_MAX_THREADS) n=NL_SCAN_MAX_THREADS;
+    loader.nthreads=n; loader.active=1;
+    doc_reset();
+    for(int i=0;i<n;i++) loader.started[i]=thread_start(&loader.th[i],load_worker,(void*)(size_t)i);
+    for(int i=0;i<n;i++) if(!loader.started[i]) load_worker((void*)(size_t)i);
+}
+// 一次保存：:w 在前台写好临时文件，自动保存则由后台线程写出快照；随后落盘并原子替换目标文件
+typedef struct {
+    FILE *fp;
+    char tmp[272], target[256];
+    size_t base;             // 保存的文档长度
+    long mark;               // 开始保存时交换日志的长度
+    unsigned gen;            // 开始保存时的 edit_gen
+    TextWriter tw;           // 按文档的编码与换行写临时文件
+    int err;
+    int autosave;            // 自动保存：临时文件由后台线程从快照写出
+    Piece *snap;             // 快照的片段树（持有一个引用）
+    const char *orig, *add;  // 快照引用的两个缓冲的数据
+} SaveJob;
+SaveJob save_job;
+thread_t save_thread;
+int save_busy = 0, save_threaded = 0; // 是否有尚未收尾的保存 / 其落盘是否在后台线程
+int save_done = 0;                  // 后台线程已完成（原子读写）
+int autosave_sec = 0;               // 自动保存间隔（秒），0 为关闭
+unsigned long long autosave_last = 0; // 上次开始自动保存（或开启）的时刻
+char autosave_status[64] = "";      // 最近一次自动保存的结果
+
+// 按文档顺序写出快照中的片段
+int snap_write(const Piece *t, SaveJob *j) {
+    if(!t) return 0;
+    if(snap_write(t->l,j)) return 1;
+    const char *d=(t->buf==BUF_ORIG?j->orig:j->add)+t->start;
+    if(text_write(&j->tw,d,t->len,0)) return 1;
+    return snap_write(t->r,j);
+}
+void save_commit(SaveJob *j) {
+    if(j->autosave) { j->err=snap_write(j->snap,j)||text_write(&j->tw,"\n",1,1); text_writer_end(&j->tw); }
+    if(!j->err) file_sync(j->fp);
+    if(fclose(j->fp)!=0) j->err=1;
+    j->fp=NULL;
+    if(!j->err) j->err=!file_replace(j->tmp,j->target);
+    if(j->err) remove_utf8(j->tmp);
+}
+void save_worker(void *arg) {
+    save_commit((SaveJob*)arg);
+    __atomic_store_n(&save_done,1,__ATOMIC_RELEASE);
+}
+void follow_saved();
+// 收尾已完成的保存（wait 为真时等待后台线程结束）：成功则以新文件为基准重写交换日志；返回是否收尾了一次保存
+int save_finish(int wait) {
+    SaveJob *j=&save_job;
+    if(!save_busy) return 0;
+    if(save_threaded) {
+        if(!wait&&!__atomic_load_n(&save_done,__ATOMIC_ACQUIRE)) return 0;
+        thread_join(save_thread);
+    }
+    save_busy=0;
+    if(j->autosave) { pt_release(j->snap); j->snap=NULL; textbuf_unpin(&add_buf); }
+    if(!j->err) { swap_rebase(j->base,j->mark); saved_gen=j->gen; follow_saved(); }
+    if(j->autosave) {
+        time_t t=time(NULL); struct tm *tm=localtime(&t);
+        if(j->err) snprintf(autosave_status,sizeof(autosave_status),"自动保存失败");
+        else snprintf(autosave_status,sizeof(autosave_status),"已自动保存 %02d:%02d:%02d",tm->tm_hour,tm->tm_min,tm->tm_sec);
+    } else if(j->err) {
+        char msg[512]; snprintf(msg,sizeof(msg),"保存 %s 失败，原文件未改动。按任意键返回\n",j->target);
+        print_utf8(msg); term_getkey();
+    }
+    return 1;
+}
+void save_exit() { save_finish(1); }
+// 为保存到fname打开临时文件并登记本次保存；失败返回NULL
+SaveJob *save_begin(const char *fname) {
+    load_finish(); save_finish(1);
+    if(!MAP_SURVIVES_REPLACE) textbuf_detach(&orig_buf);
+    SaveJob *j=&save_job;
+    snprintf(j->tmp,sizeof(j->tmp),"%s.tmp",fname);
+    j->fp=fopen_utf8(j->tmp,"wb");
+    if(!j->fp) return NULL;
+    setvbuf(j->fp,NULL,_IOFBF,SAVE_BUF);
+    if(text_writer_begin(&j->tw,j->fp,doc_enc,doc_crlf,doc_bom)) { fclose(j->fp); remove_utf8(j->tmp); return NULL; }
+    snprintf(j->target,sizeof(j->target),"%s",fname);
+    j->base=pt_length(); j->gen=edit_gen; j->err=0; j->autosave=0; j->snap=NULL;
+    return j;
+}
+// 登记交换日志位置后开始落盘：后台线程可用且 background 为真时交给线程，否则就地完成
+void save_start(SaveJob *j, int background) {
+    char name[264]; snprintf(name,sizeof(name),"%s.swp",j->target);
+    if(!swap_fp||strcmp(name,swap_name)) swap_open(j->target);
+    swap_flush(0);
+    j->mark=swap_fp?ftell(swap_fp):0;
+    save_busy=1; save_done=0;
+    save_threaded=background&&thread_start(&save_thread,save_worker,j);
+    if(!save_threaded) { save_commit(j); save_finish(1); }
+}
+// 保存文件：整个文档按片段顺序（转回文件原来的编码与换行）经大缓冲写入临时文件，落盘后原子替换目标；写失败时目标不受影响。
+// 大文件的落盘与替换在后台线程进行，:w 立即返回
+void file_save(const char *fname) {
+    SaveJob *j=save_begin(fname);
+    if (!j) { char msg[512]; snprintf(msg,sizeof(msg),"无法打开文件: %s\n",fname); print_utf8(msg); return; }
+    int err=pt_walk(pt_root,0,0,pt_length(),file_write_visit,&j->tw);
+    if(text_write(&j->tw,"\n",1,1)||fflush(j->fp)!=0) err=1;
+    text_writer_end(&j->tw);
+    if(err) {
+        fclose(j->fp); remove_utf8(j->tmp);
+        char msg[512]; snprintf(msg,sizeof(msg),"写入 %s 失败，原文件未改动\n",fname); print_utf8(msg); return;
+    }
     strncpy(filename, fname, 255); filename[255]=0;
-    char msg[512]; snprintf(msg,sizeof(msg),"已保存到 %s\n",fname); print_utf8(msg);
+    save_start(j,j->base>=SAVE_ASYNC_MIN);
+    if(!save_threaded&&j->err) return;
+    char msg[512]; snprintf(msg,sizeof(msg),save_threaded?"已保存到 %s（后台落盘）\n":"已保存到 %s\n",fname); print_utf8(msg);
+}
+// 自动保存：快照只是给片段树根加一个引用并钉住添加缓冲当前的数据块（O(1)），之后的编辑按需复制
+// 被共享的节点；后台线程把快照写入临时文件后落盘替换，主循环照常处理按键
+void autosave_start() {
+    SaveJob *j=save_begin(filename);
+    if(!j) { snprintf(autosave_status,sizeof(autosave_status),"自动保存失败"); return; }
+    j->autosave=1; j->snap=pt_root;
+    if(pt_root) pt_root->ref++;
+    j->orig=orig_buf.data; j->add=add_buf.data; add_buf.pinned=add_buf.data;
+    save_start(j,1);
+}
+// 到期且有未保存的修改时开始自动保存；返回是否开始了
+int autosave_tick() {
+    if(!autosave_sec||!filename[0]||save_busy||loader.active||edit_gen==saved_gen) return 0;
+    unsigned long long t=now_ns();
+    if(t-autosave_last<(unsigned long long)autosave_sec*1000000000ULL) return 0;
+    autosave_last=t; autosave_start();
+    return 1;
+}
+
+// ------------- 跟随文件增长 -------------
+// :follow 后只读入文件新增的字节：映射的原始缓冲重新映射到新长度，已复制的（转码或 \r\n 归一化过的）转换后在末尾追加，
+// 只索引新内容里的换行，再作为原始缓冲片段接到文档末尾，开销与新增的字节数成正比。
+// Linux 用 inotify 在文件变化时唤醒主循环，其它平台定时检查文件大小；两次读入至少间隔 FOLLOW_MIN_MS。
+
+typedef struct {
+    int on;
+    size_t size;             // 原始缓冲对应的文件字节数（保存后原始缓冲不再对应磁盘文件，为 (size_t)-1）
+    int copy, crlf;          // 原始缓冲是转码后的副本 / 副本中 \r\n 归一化为 \n
+    size_t end;              // 已接入文档的原始缓冲字节数
+    int wd, dirty;           // 文件变化通知（-1 为定时检查）/ 有尚未读入的变化
+    unsigned long long polled, read; // 上次检查 / 上次读入的时刻
+    const char *note;        // 停止跟随的原因（显示在模式行）
+} Follow;
+Follow follow = { 0, 0, 0, 0, -1 };
+
+// 停止跟随，note 为显示给用户的原因
+void follow_stop(const char *note) {
+    if(follow.on) watch_close(follow.wd);
+    follow.on=0; follow.wd=-1; follow.note=note;
+}
+// 读入文件新增的部分；返回文档是否有变化
+int follow_read() {
+    size_t size, msize; char *data;
+    if(!file_size_of(filename,&size)||size==follow.size) return 0;
+    if(size<follow.size) { follow_stop("文件被截断，已停止跟随"); return 1; }
+    if(!file_map(filename,&data,&msize)||!data) return 0;
+    if(msize<=follow.size) { file_unmap(data,msize); return 0; }
+    TextBuf *b=&orig_buf;
+    size_t from=b->len;
+    if(!follow.copy) {  // 原始缓冲即文件的前缀：换成新的映射（打开时为空文件的也从此改为映射）
+        if(b->mapped) file_unmap(b->data,b->len); else free(b->data);
+        b->data=data; b->len=b->cap=msize; b->mapped=1; follow.size=msize;
+    } else {  // 分段转换，末尾不完整的字符与单独的 \r 留到下次与其后的内容一起读入
+        size_t n=msize-follow.size, used;
+        if(b->len+text_decode_max(doc_enc,n)>b->cap) { b->cap=b->len+text_decode_max(doc_enc,n); b->data=(char*)realloc(b->data,b->cap); }
+        const char *p=data+follow.size;
+        while(n) {
+            size_t k=n<LOAD_CHUNK?n:LOAD_CHUNK;
+            b->len=text_convert(doc_enc,follow.crlf,p,k,b->data,b->len,&used,0,NULL);
+            if(!used) break;
+            p+=used; n-=used; follow.size+=used;
+        }
+        file_unmap(data,msize);
+    }
+    textbuf_index_tail(b,from,b->len);
+    if(view_mode&&b->mapped) file_drop(b->data+from,b->len-from);
+    size_t end=b->len&&b->data[b->len-1]=='\n'?b->len-1:b->len;
+    if(end<=follow.end) return 0;
+    int tail=cy==line_count-1;
+    doc_append_orig(follow.end,end); follow.end=end;
+    if(swap_fp) swap_grow=end;
+    if(tail) { cy=line_count-1; if(cx>line_width(cy)) cx=line_width(cy); }  // 光标在末行时跟到新的末行
+    return 1;
+}
+// 保存后磁盘上的文件换成了文档内容，原始缓冲不再是它的前缀，停止跟随
+void follow_saved() {
+    follow.size=(size_t)-1;
+    if(follow.on) follow_stop("已保存，停止跟随");
+}
+// 开始跟随当前文件；不能跟随时返回原因
+const char *follow_start() {
+    if(!filename[0]) return "当前未打开文件";
+    if(follow.size==(size_t)-1) return "文件已保存过，磁盘上的内容与打开时不再对应，请先用 :r 重新打开";
+    load_finish(); follow_stop(NULL);
+    TextBuf *b=&orig_buf;
+    if(view_mode&&!b->nl_step) {  // 只读查看时改为稀疏索引，跟随再久换行索引也不会变大
+        size_t k=0;
+        for(size_t i=NL_SPARSE_STEP-1;i<b->nl_count;i+=NL_SPARSE_STEP) b->nl[k++]=b->nl[i];
+        b->nl_count=k; b->nl_step=NL_SPARSE_STEP;
+    }
+    follow.end=b->len&&b->data[b->len-1]=='\n'?b->len-1:b->len;
+    follow.wd=watch_open(filename); follow.on=1; follow.dirty=1; follow.polled=now_ns(); follow.read=0;
+    return NULL;
+}
+// 处理文件变化：有通知或到了检查时间就标记，距上次读入足够久才读入；返回文档是否有变化
+int follow_poll() {
+    if(!follow.on) return 0;
+    unsigned long long t=now_ns();
+    if(follow.wd>=0) { if(watch_drain(follow.wd)) follow.dirty=1; }
+    else if(t-follow.polled>=FOLLOW_POLL_MS*1000000ULL) { follow.polled=t; follow.dirty=1; }
+    if(!follow.dirty||save_busy||t-follow.read<FOLLOW_MIN_MS*1000000ULL) return 0;
+    follow.dirty=0; follow.read=t;
+    return follow_read();
+}
+// 距下一次需要 follow_poll 的毫秒数，-1 表示只等文件变化通知
+int follow_timeout() {
+    if(!follow.on) return -1;
+    unsigned long long t=now_ns(), due;
+    if(follow.dirty) due=follow.read+FOLLOW_MIN_MS*1000000ULL;
+    else if(follow.wd<0) due=follow.polled+FOLLOW_POLL_MS*1000000ULL;
+    else return -1;
+    return t>=due?0:(int)((due-t)/1000000)+1;
+}
+// 主循环等待按键的最长毫秒数：加载中或后台保存未结束时短暂等待，否则等到下一次自动保存或跟随检查到期，-1 表示一直等待
+int wait_timeout() {
+    if(loader.active) return 20;
+    if(save_busy) return 50;
+    int f=follow_timeout();
+    if(!autosave_sec||!filename[0]||edit_gen==saved_gen) return f;
+    unsigned long long due=autosave_last+(unsigned long long)autosave_sec*1000000000ULL, t=now_ns();
+    int ms=t>=due?0:(int)((due-t)/1000000)+1;
+    return f>=0&&f<ms?f:ms;
+}
+// 加载文件：映射为原始缓冲，只有屏幕需要的行才会被读出；非UTF-8编码或 \r\n 文件需归一化时才转码复制。
+// 大文件在后台加载，先显示已加载的部分；只读查看时不归一化，换行索引只留稀疏检查点
+void file_load(const char *fname) {
+    char *data; size_t size;
+    follow_stop(NULL);
+    if (!file_map(fname,&data,&size)) { char msg[512]; snprintf(msg,sizeof(msg),"无法打开文件: %s\n",fname); print_utf8(msg); return; }
+    int mapped=data!=NULL;
+    size_t bom; int enc=text_detect(data,size,&bom), style=text_crlf(enc,data,size,bom);
+    int crlf=style>0&&!view_mode, copy=crlf||enc!=ENC_UTF8;
+    doc_enc=enc; doc_bom=bom>0; doc_crlf=style<0?DEFAULT_CRLF:style;
+    syntax_set(syntax_for(fname));
+    follow.size=size; follow.copy=copy; follow.crlf=crlf;
+    if(mapped&&size>=LOAD_ASYNC_MIN) {
+        int rows, cols; get_win_size(&rows,&cols);
+        load_start(data,size,enc,crlf,bom);
+        load_wait_lines(rows);  // 首屏只等够一屏的行
+    } else {
+        if(copy) {
+            size_t len; char *out=text_decode_all(enc,crlf,data+bom,size-bom,&len);
+            file_unmap(data,size); data=out; size=len; mapped=0; follow.copy=1; bom=0;
+        }
+        doc_replace_at(data,size,bom,mapped);  // 带 BOM 的UTF-8仍然直接映射，文档从 BOM 之后开始
+    }
+    strncpy(filename, fname, 255); filename[255]=0;
+    if(!view_mode) swap_start(filename);
+    char msg[512]; snprintf(msg,sizeof(msg),"已打开文件: %s\n",fname); print_utf8(msg);
+}
+
+// ------------- 撤销日志 -------------
+// 只记录每次插入/删除的字节与光标；连续输入合并为一组，总占用受 UNDO_MEM_LIMIT 约束
+
+// 释放一个撤销组
+void undo_group_free(UndoGroup *g) {
+    for(int i=0;i<g->nops;i++) { undo_bytes-=g->ops[i].len+sizeof(UndoOp); pool_free(&undo_pool,g->ops[i].text,g->ops[i].len); }
+    undo_bytes-=sizeof(UndoGroup);
+    pool_free(&undo_pool,g->ops,g->cap*sizeof(UndoOp)); pool_free(&undo_pool,g,sizeof(UndoGroup));
+}
+// 丢弃当前位置之后（可重做）的所有组
+void undo_drop_redo() {
+    UndoGroup *g=undo_pos?undo_pos->next:undo_first;
+    while(g) { UndoGroup *n=g->next; undo_group_free(g); g=n; }
+    if(undo_pos) undo_pos->next=NULL; else undo_first=NULL;
+    undo_last=undo_pos;
+}
+// 超出内存上限时从最旧的组开始丢弃
+void undo_trim() {
+    while(undo_bytes>UNDO_MEM_LIMIT&&undo_first&&undo_first!=undo_pos) {
+        UndoGroup *g=undo_first;
+        undo_first=g->next; undo_first->prev=NULL;
+        undo_group_free(g);
+    }
+}
+// 结束当前撤销组，之后的编辑开启新组
+void undo_close() {
+    if(!undo_open) return;
+    undo_pos->cx1=cx; undo_pos->cy1=cy; undo_open=0;
+}
+// 编辑边界（模式切换、移动光标等）：一批输入处理完之前不结束撤销组，整批合为一组，批末再结束
+void undo_seal() { if(!undo_hold) undo_close(); else undo_seal_pending=1; }
+// 一批输入处理完：执行推迟的编辑边界
+void undo_release() {
+    undo_hold=0;
+    if(undo_seal_pending) { undo_seal_pending=0; undo_close(); }
+}
+// 记录一次编辑（接管text）；与上一操作相邻的连续输入/删除直接合并
+void undo_record(int del, size_t off, char *text, size_t n) {
+    if(!undo_open) {
+        undo_drop_redo();
+        UndoGroup *g=(UndoGroup*)pool_alloc(&undo_pool,sizeof(UndoGroup));
+        memset(g,0,sizeof(UndoGroup));
+        g->cx0=cx; g->cy0=cy; g->prev=undo_last;
+        if(undo_last) undo_last->next=g; else undo_first=g;
+        undo_last=undo_pos=g; undo_open=1;
+        undo_bytes+=sizeof(UndoGroup);
+    }
+    UndoGroup *g=undo_pos;
+    UndoOp *last=g->nops?&g->ops[g->nops-1]:NULL;
+    if(last&&last->del==del&&((!del&&off==last->off+last->len)||(del&&off==last->off))) {
+        last->text=(char*)pool_realloc(&undo_pool,last->text,last->len,last->len+n);
+        memcpy(last->text+last->len,text,n); last->len+=n; pool_free(&undo_pool,text,n);
+    } else if(last&&del&&last->del&&off+n==last->off) {
+        last->text=(char*)pool_realloc(&undo_pool,last->text,last->len,last->len+n);
+        memmove(last->text+n,last->text,last->len); memcpy(last->text,text,n);
+        last->off=off; last->len+=n; pool_free(&undo_pool,text,n);
+    } else {
+        if(g->nops==g->cap) {
+            int cap=g->cap?g->cap*2:4;
+            g->ops=(UndoOp*)pool_realloc(&undo_pool,g->ops,g->cap*sizeof(UndoOp),cap*sizeof(UndoOp)); g->cap=cap;
+        }
+        UndoOp *op=&g->ops[g->nops++];
+        op->del=del; op->off=off; op->len=n; op->text=text;
+        undo_bytes+=sizeof(UndoOp);
+    }
+    undo_bytes+=n;
+    undo_trim();
+}
+// 撤销/重做后把光标限制在文本范围内
+void undo_clamp_cursor() {
+    if(cy>=line_count) cy=line_count-1;
+    if(cy<0) cy=0;
+    if(cx>line_width(cy)) cx=line_width(cy);
+}
+// 撤销：逆序执行最近一组的反操作
+void undo_restore() {
+    undo_close();
+    if(!undo_pos) return;
+    UndoGroup *g=undo_pos;
+    undo_replaying=1;
+    for(int i=g->nops-1;i>=0;i--) {
+        UndoOp *op=&g->ops[i];
+        if(op->del) buf_insert(op->off,op->text,op->len); else buf_delete(op->off,op->len);
+    }
+    undo_replaying=0;
+    cx=g->cx0; cy=g->cy0; undo_pos=g->prev;
+    undo_clamp_cursor();
 }
-// 加载文件
-void file_load(const char *fname) {
-    FILE *fp = fopen_utf8(fname, "r");
-    if (!fp) { char msg[512]; snprintf(msg,sizeof(msg),"无法打开文件: %s\n",fname); print_utf8(msg); return; }
-    line_count=0;
-    while(fgets(lines[line_count],MAX_COLS,fp)&&line_count<MAX_LINES) {
-        size_t len=strlen(lines[line_count]);
-        if(len&&lines[line_count][len-1]=='\n') lines[line_count][len-1]=0;
-        line_count++;
+// 重做：顺序重放下一组
+void redo_restore() {
+    undo_close();
+    UndoGroup *g=undo_pos?undo_pos->next:undo_first;
+    if(!g) return;
+    undo_replaying=1;
+    for(int i=0;i<g->nops;i++) {
+        UndoOp *op=&g->ops[i];
+        if(op->del) buf_delete(op->off,op->len); else buf_insert(op->off,op->text,op->len);
     }
-    fclose(fp);
-    strncpy(filename, fname, 255); filename[255]=0;
-    char msg[512]; snprintf(msg,sizeof(msg),"已打开文件: %s\n",fname); print_utf8(msg);
+    undo_replaying=0;
+    cx=g->cx1; cy=g->cy1; undo_pos=g;
+    undo_clamp_cursor();
 }
-
-// 撤销保存
-void undo_save() {
-    UndoState *u = &undo_stack[undo_top];
-    for (int i=0;i<line_count;i++) strcpy(u->lines[i],lines[i]);
-    u->line_count=line_count; u->cx=cx; u->cy=cy;
-    undo_top=(undo_top+1)%UNDO_STACK;
-    if(undo_top==undo_cur) undo_cur=(undo_cur+1)%UNDO_STACK;
+// 清空撤销日志（换入新文档时，旧记录的偏移已失效）
+void undo_clear() {
+    undo_open=0; undo_first=undo_last=undo_pos=NULL;
+    pool_reset(&undo_pool); undo_bytes=0;
 }
-// 撤销恢复
-void undo_restore() {
-    if(undo_top==undo_cur) return;
-    undo_top=(undo_top-1+UNDO_STACK)%UNDO_STACK;
-    UndoState *u=&undo_stack[undo_top];
-    for(int i=0;i<u->line_count;i++) strcpy(lines[i],u->lines[i]);
-    line_count=u->line_count; cx=u->cx; cy=u->cy;
+// 压缩撤销池：按时间顺序把所有组搬到新池，旧池整体释放
+void undo_compact() {
+    Pool fresh; memset(&fresh,0,sizeof(fresh));
+    UndoGroup *prev=NULL, *pos=NULL;
+    for(UndoGroup *g=undo_first;g;g=g->next) {
+        UndoGroup *n=(UndoGroup*)pool_alloc(&fresh,sizeof(UndoGroup));
+        *n=*g; n->prev=prev; n->next=NULL;
+        n->ops=g->cap?(UndoOp*)pool_alloc(&fresh,g->cap*sizeof(UndoOp)):NULL;
+        for(int i=0;i<g->nops;i++) {
+            n->ops[i]=g->ops[i];
+            n->ops[i].text=(char*)pool_alloc(&fresh,g->ops[i].len);
+            memcpy(n->ops[i].text,g->ops[i].text,g->ops[i].len);
+        }
+        if(prev) prev->next=n; else undo_first=n;
+        if(g==undo_pos) pos=n;
+        prev=n;
+    }
+    undo_last=prev; undo_pos=pos;
+    pool_reset(&undo_pool); undo_pool=fresh;
+}
+// 片段池、撤销池空闲过多时压缩（每批输入处理完调用）
+void mem_compact() {
+    if(!save_busy&&pool_fragmented(&piece_pool)) pt_compact();
+    if(pool_fragmented(&undo_pool)) undo_compact();
 }
 
 // 调整纵向滚动
 void adjust_scroll(int help_lines) {
-    HANDLE hOut=GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hOut,&csbi);
-    int win_rows=csbi.srWindow.Bottom-csbi.srWindow.Top+1;
+    int win_rows, win_cols;
+    get_win_size(&win_rows,&win_cols);
     int text_rows=win_rows-help_lines-1;
     if(text_rows<1) text_rows=1;
     int max_scroll = (line_count > text_rows) ? line_count - text_rows : 0;
@@ -297,135 +2685,1136 @@ void adjust_hscroll(int win_cols) {
 
 // 清空屏幕缓冲
 void clear_screen_buf(int rows, int cols) {
-    for(int i=0;i<rows;i++) { memset(screenbuf[i],' ',cols); if(cols>0) screenbuf[i][cols-1]=0; }
+    for(int i=0;i<rows;i++) for(int j=0;j<cols;j++) { ScreenCell *c=&screenbuf[i][j]; c->ch[0]=' '; c->len=1; c->width=1; c->attr=HL_NONE; }
+}
+// 在屏幕(row,col)放一个字形簇；控制字符显示为空格/问号，无基字符的组合符号前补空格，宽字符占两格；
+// 超出单元格容量的簇在码点边界截断
+void screen_put(int row, int col, const char *s, int clen, int width) {
+    ScreenCell *c=&screenbuf[row][col];
+    c->len=0; c->attr=HL_NONE;
+    if((unsigned char)s[0]<0x20||s[0]==0x7f) { c->ch[0]=s[0]=='\t'?' ':'?'; c->len=1; }
+    else if(clen==1) { c->ch[0]=s[0]; c->len=1; }
+    else {
+        int cp;
+        if((unsigned char)s[0]>=0x80&&(utf8_decode(s,&cp),cp_width(cp)==0)) c->ch[c->len++]=' ';
+        for(int k=0;k<clen&&s[k];) {
+            int n=utf8_decode(s+k,&cp);
+            if(c->len+n>CELL_BYTES) break;
+            memcpy(c->ch+c->len,s+k,n); c->len+=n; k+=n;
+        }
+    }
+    c->width=(unsigned char)width;
+    if(width==2) { ScreenCell *n=c+1; n->len=0; n->width=0; n->attr=HL_NONE; }
+}
+// 从第col列起写入n字节UTF-8文本，不超过cols-1列，返回写到的列
+int screen_put_textn(int row, int col, int cols, const char *s, int n) {
+    for(int i=0;i<n&&s[i];) {
+        int clen=cluster_len(s,i), w=char_width(s,i);
+        if(i+clen>n) clen=n-i;
+        if(col+w>cols-1) break;
+        screen_put(row,col,s+i,clen,w); col+=w; i+=clen;
+    }
+    return col;
+}
+// 用文本填满屏幕一行（截断或补空格）
+void screen_row_textn(int row, int cols, const char *s, int n) {
+    for(int j=0;j<cols;j++) screen_put(row,j," ",1,1);
+    screen_put_textn(row,0,cols,s,n);
+}
+void screen_row_text(int row, int cols, const char *s) { screen_row_textn(row,cols,s,(int)strlen(s)); }
+// 设置本帧光标位置
+void screen_cursor(int x, int y) { cur_x=x; cur_y=y; }
+// 单元格是否相同（只比较已用字节）
+int cell_eq(const ScreenCell *a, const ScreenCell *b) {
+    if(a->len!=b->len||a->width!=b->width||a->attr!=b->attr||a->ch[0]!=b->ch[0]) return 0;
+    return a->len<=1||memcmp(a->ch+1,b->ch+1,a->len-1)==0;
 }
 
-// 刷新屏幕缓冲到控制台
+// 刷新屏幕缓冲到终端：与上一帧逐行比较，只把变化的区间交给后端；
+// 后端把各区间与光标定位拼成一次写出，光标仅移动时只输出定位
 void flush_screen_buf(int rows, int cols) {
-    HANDLE hOut=GetStdHandle(STD_OUTPUT_HANDLE); COORD pos={0,0}; DWORD written;
-    for(int i=0;i<rows;i++) { pos.X=0; pos.Y=i; WriteConsoleOutputCharacterA(hOut,screenbuf[i],cols-1,pos,&written); }
+    int full=!screen_valid||rows!=prev_rows||cols!=prev_cols, dirty=0;
+    term.begin_frame(full);
+    for(int i=0;i<rows;i++) {
+        int a=0, b=cols-1;
+        if(!full) {
+            while(a<b&&cell_eq(&screenbuf[i][a],&prevbuf[i][a])) a++;
+            while(b>a&&cell_eq(&screenbuf[i][b-1],&prevbuf[i][b-1])) b--;
+            if(a>=b) continue;
+            // 区间两端不能切开宽字符
+            if(a>0&&(screenbuf[i][a].width==0||prevbuf[i][a].width==0)) a--;
+            if(b<cols-1&&(screenbuf[i][b].width==0||prevbuf[i][b].width==0)) b++;
+        }
+        dirty=1;
+        term.put_span(i,a,&screenbuf[i][a],b-a);
+        memcpy(&prevbuf[i][a],&screenbuf[i][a],(b-a)*sizeof(ScreenCell));
+    }
+    prev_rows=rows; prev_cols=cols; screen_valid=1;
+    if(!dirty&&cur_x==prev_cur_x&&cur_y==prev_cur_y) return;
+    prev_cur_x=cur_x; prev_cur_y=cur_y;
+    term.end_frame(cur_x,cur_y,dirty);
 }
 
 // 统计字符串行数
 int count_lines(const char *s) { int n=1; for(;*s;s++) if(*s=='\n') n++; return n; }
 
-// 显示底部帮助
+// 在屏幕从row行起逐行显示多行文本，返回下一行
+int screen_lines(int row, int cols, const char *p) {
+    while(*p) { int len=0; while(p[len]&&p[len]!='\n') len++;
+        screen_row_textn(row++,cols,p,len);
+        if(p[len]=='\n') p+=len+1; else break;
+    }
+    return row;
+}
+
+int match_rank(int line);
+// 显示底部帮助；有搜索索引时模式行附带“匹配 k/N”，输入了数字前缀时附带该数字
 void show_bottom_help(const char *help, int win_rows, int win_cols) {
-    int help_lines=count_lines(help)+2, start_line=win_rows-help_lines, line=start_line;
-    if(insert_mode) {
-        snprintf(screenbuf[line],win_cols,"%-*s",win_cols-1,"插入模式"); line++;
-        const char *p=insert_help;
-        while(*p) { int len=0; while(p[len]&&p[len]!='\n') len++;
-            snprintf(screenbuf[line],win_cols,"%.*s%*s",len,p,win_cols-1-len,""); line++;
-            if(p[len]=='\n') p+=len+1; else break;
-        }
-    } else {
-        snprintf(screenbuf[line],win_cols,"%-*s",win_cols-1,"正常模式"); line++;
-        const char *p=normal_help;
-        while(*p) { int len=0; while(p[len]&&p[len]!='\n') len++;
-            snprintf(screenbuf[line],win_cols,"%.*s%*s",len,p,win_cols-1-len,""); line++;
-            if(p[len]=='\n') p+=len+1; else break;
-        }
+    int help_lines=count_lines(help)+2, line=win_rows-help_lines;
+    char status[256]; int n=snprintf(status,sizeof(status),"%s",view_mode?"只读模式":insert_mode?"插入模式":"正常模式");
+    if(last_pat[0]&&match_valid&&match_regex==last_regex&&!strcmp(match_pat,last_pat)) {
+        int k=match_rank(cy);
+        if(k) n+=snprintf(status+n,sizeof(status)-n,"  /%s  匹配 %d/%d",last_pat,k,match_count);
+        else n+=snprintf(status+n,sizeof(status)-n,"  /%s  匹配 -/%d",last_pat,match_count);
+    }
+    if(cmd_count) n+=snprintf(status+n,sizeof(status)-n,"  %d",cmd_count);
+    if(doc_enc!=ENC_UTF8||doc_bom||doc_crlf!=DEFAULT_CRLF)
+        n+=snprintf(status+n,sizeof(status)-n,"  %s%s %s",enc_names[doc_enc],doc_bom&&doc_enc==ENC_UTF8?"(BOM)":"",doc_crlf?"CRLF":"LF");
+    if(loader.active) n+=snprintf(status+n,sizeof(status)-n,"  加载中 %d 行 %d%%",line_count,(int)(loader.taken*100/loader.nchunks));
+    if(follow.on) n+=snprintf(status+n,sizeof(status)-n,"  跟随中");
+    else if(follow.note) n+=snprintf(status+n,sizeof(status)-n,"  %s",follow.note);
+    if(autosave_sec) {
+        if(save_busy&&save_job.autosave) snprintf(status+n,sizeof(status)-n,"  自动保存中");
+        else if(autosave_status[0]) snprintf(status+n,sizeof(status)-n,"  %s",autosave_status);
+        else snprintf(status+n,sizeof(status)-n,"  自动保存：每 %d 秒",autosave_sec);
     }
-    snprintf(screenbuf[win_rows-1],win_cols,": %-*s",win_cols-3,"");
+    screen_row_text(line++,win_cols,status);
+    screen_lines(line,win_cols,insert_mode?insert_help:normal_help);
+    screen_row_text(win_rows-1,win_cols,": ");
 }
 
 // 绘制界面
 void draw() {
-    HANDLE hOut=GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hOut,&csbi);
     //获取行数和列数
-    int win_rows=csbi.srWindow.Bottom-csbi.srWindow.Top+1;
-    int win_cols=csbi.srWindow.Right-csbi.srWindow.Left+1;
-    if(win_rows>MAX_ROWS) win_rows=MAX_ROWS;
-    if(win_cols>MAX_COLS_SCREEN) win_cols=MAX_COLS_SCREEN;
+    int win_rows, win_cols;
+    get_win_size(&win_rows,&win_cols);
     //根据模式获取帮助信息
     const char *help=insert_mode?insert_help:normal_help;
     int help_lines=count_lines(help)+2, text_rows=win_rows-help_lines-1;
     if(text_rows<1) text_rows=1;
+    unsigned long long t=now_ns();
     adjust_scroll(help_lines); adjust_hscroll(win_cols);
+    t=perf_mark(PERF_SCROLL,t);
     clear_screen_buf(win_rows,win_cols);
-    //循环清空并填充缓冲区
+    hl_sync(scroll+text_rows);
+    //填充文本区，超出文档的行保持空白
     for(int i=0;i<text_rows;i++) {
         int idx=scroll+i, col=0;
-        if(idx>=line_count) { memset(screenbuf[i],' ',win_cols-1); screenbuf[i][win_cols-1]=0; continue; }
-        if(show_lineno) { snprintf(screenbuf[i],win_cols,"%4d ",idx+1); col=5; }
-        int realj=vis2real(lines[idx],hscroll);
-        while(lines[idx][realj]&&col<win_cols-1) {
-            int clen=utf8_len((unsigned char)lines[idx][realj]);
-            int cwidth=char_width(lines[idx],realj);
+        if(idx>=line_count) continue;
+        if(show_lineno) { char num[16]; snprintf(num,sizeof(num),"%4d ",idx+1); col=screen_put_textn(i,0,win_cols,num,5); }
+        LineSlot *ls=line_slot(idx);
+        const char *ln=ls->text;
+        const unsigned char *attr=hl_line(idx,ln,ls->len);
+        int realj=line_vis2real(idx,hscroll);
+        while(ln[realj]&&col<win_cols-1) {
+            unsigned char c=(unsigned char)ln[realj];
+            // 可打印ASCII且下一字节不是组合符号的起始：单字节单列，直接写入单元格
+            if(c>=0x20&&c<0x7f&&(unsigned char)ln[realj+1]<0x80) {
+                ScreenCell *sc=&screenbuf[i][col++];
+                sc->ch[0]=(char)c; sc->len=1; sc->width=1; sc->attr=attr?attr[realj]:HL_NONE; realj++;
+                continue;
+            }
+            int clen=cluster_len(ln,realj);
+            int cwidth=char_width(ln,realj);
             if(col+cwidth>win_cols-1) break;
-            for(int k=0;k<clen&&col<win_cols-1;k++) screenbuf[i][col++]=lines[idx][realj+k];
-            realj+=clen;
+            screen_put(i,col,ln+realj,clen,cwidth);
+            if(attr) screenbuf[i][col].attr=attr[realj];
+            col+=cwidth; realj+=clen;
         }
-        if(col<win_cols-1) screenbuf[i][col++]=' ';
-        while(col<win_cols-1) screenbuf[i][col++]=' ';
-        screenbuf[i][win_cols-1]=0;
     }
-    int blank_line=text_rows;
-    if(blank_line<win_rows-1) { memset(screenbuf[blank_line],' ',win_cols-1); screenbuf[blank_line][win_cols-1]=0; }
     show_bottom_help(help,win_rows,win_cols);
+    int display_x=line_real2vis(cy,line_vis2real(cy,cx))-line_real2vis(cy,line_vis2real(cy,hscroll));
+    screen_cursor((show_lineno?5:0)+display_x,cy-scroll);
+    t=perf_mark(PERF_BUILD,t);
     flush_screen_buf(win_rows,win_cols);
-    int display_x=0, realpos=vis2real(lines[cy],cx), realstart=vis2real(lines[cy],hscroll);
-    for(int i=realstart;i<realpos;) { display_x+=char_width(lines[cy],i); i+=utf8_len((unsigned char)lines[cy][i]); }
-    COORD pos; pos.X=(show_lineno?5:0)+display_x; pos.Y=cy-scroll;
-    SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE),pos);
+    perf_mark(PERF_FLUSH,t);
+}
+
+// ------------- 搜索 -------------
+// 在片段所在的连续内存上直接查找，不逐行读出：向量内核先用首、尾字节同时过滤候选位置，再逐字节确认；
+// 跨片段边界的匹配用上一片段末尾 m-1 字节与下一片段开头拼成的小窗口补查。只折叠ASCII大小写。
+
+// 预处理后的搜索串：ASCII字母统一为小写
+typedef struct {
+    char low[SEARCH_PAT_MAX];
+    size_t m;
+} SearchPat;
+
+// ASCII字母转小写
+unsigned char ascii_lower(unsigned char c) { return (unsigned char)(c-'A')<26?c+32:c; }
+// 预处理搜索串（超长部分截断）
+void search_pat_init(SearchPat *sp, const char *pat) {
+    sp->m=0;
+    while(pat[sp->m]&&sp->m<SEARCH_PAT_MAX) { sp->low[sp->m]=(char)ascii_lower((unsigned char)pat[sp->m]); sp->m++; }
+}
+// h起的m字节是否与小写搜索串相同（忽略ASCII大小写）
+int fold_eq(const char *h, const char *low, size_t m) {
+    for(size_t i=0;i<m;i++) if(ascii_lower((unsigned char)h[i])!=(unsigned char)low[i]) return 0;
+    return 1;
+}
+// 标量内核：从h+i起查找，返回匹配起点或NULL
+const char *mem_casefind_scalar(const char *h, size_t n, size_t i, const SearchPat *sp) {
+    size_t m=sp->m;
+    unsigned char f=(unsigned char)sp->low[0], l=(unsigned char)sp->low[m-1];
+    for(;i+m<=n;i++)
+        if(ascii_lower((unsigned char)h[i])==f&&ascii_lower((unsigned char)h[i+m-1])==l&&fold_eq(h+i,sp->low,m)) return h+i;
+    return NULL;
+}
+// 字母在比较前按位或0x20即可同时匹配大小写，其它字节精确比较
+#define CASE_BIT(c) ((unsigned char)((c)-'a')<26?0x20:0)
+#if defined(__SSE2__)
+// SSE2内核：每次比较16个候选起点的首、尾字节
+const char *mem_casefind_sse2(const char *h, size_t n, const SearchPat *sp) {
+    size_t m=sp->m, i=0;
+    const __m128i vf=_mm_set1_epi8(sp->low[0]), vl=_mm_set1_epi8(sp->low[m-1]);
+    const __m128i cf=_mm_set1_epi8((char)CASE_BIT(sp->low[0])), cl=_mm_set1_epi8((char)CASE_BIT(sp->low[m-1]));
+    for(;i+m-1+16<=n;i+=16) {
+        __m128i a=_mm_or_si128(_mm_loadu_si128((const __m128i*)(h+i)),cf);
+        __m128i b=_mm_or_si128(_mm_loadu_si128((const __m128i*)(h+i+m-1)),cl);
+        unsigned mask=(unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,vf),_mm_cmpeq_epi8(b,vl)));
+        while(mask) {
+            int k=__builtin_ctz(mask);
+            if(fold_eq(h+i+k,sp->low,m)) return h+i+k;
+            mask&=mask-1;
+        }
+    }
+    return mem_casefind_scalar(h,n,i,sp);
+}
+#endif
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define HAVE_AVX2_KERNEL
+// AVX2内核：每次32个候选起点，运行时检测到AVX2才使用
+__attribute__((target("avx2")))
+const char *mem_casefind_avx2(const char *h, size_t n, const SearchPat *sp) {
+    size_t m=sp->m, i=0;
+    const __m256i vf=_mm256_set1_epi8(sp->low[0]), vl=_mm256_set1_epi8(sp->low[m-1]);
+    const __m256i cf=_mm256_set1_epi8((char)CASE_BIT(sp->low[0])), cl=_mm256_set1_epi8((char)CASE_BIT(sp->low[m-1]));
+    for(;i+m-1+32<=n;i+=32) {
+        __m256i a=_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h+i)),cf);
+        __m256i b=_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h+i+m-1)),cl);
+        unsigned mask=(unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a,vf),_mm256_cmpeq_epi8(b,vl)));
+        while(mask) {
+            int k=__builtin_ctz(mask);
+            if(fold_eq(h+i+k,sp->low,m)) return h+i+k;
+            mask&=mask-1;
+        }
+    }
+    return mem_casefind_scalar(h,n,i,sp);
+}
+#endif
+int kernel_avx2 = -1;                // 是否使用AVX2内核，-1为尚未检测
+// 检测处理器支持的内核（多线程搜索前在主线程调用）
+void search_kernel_init() {
+#ifdef HAVE_AVX2_KERNEL
+    if(kernel_avx2<0) { __builtin_cpu_init(); kernel_avx2=__builtin_cpu_supports("avx2")!=0; }
+#endif
+}
+// 在[h,h+n)中查找搜索串（忽略ASCII大小写），返回匹配起点或NULL
+const char *mem_casefind(const char *h, size_t n, const SearchPat *sp) {
+    if(!sp->m) return h;
+    if(n<sp->m) return NULL;
+#ifdef HAVE_AVX2_KERNEL
+    if(kernel_avx2<0) search_kernel_init();
+    if(kernel_avx2) return mem_casefind_avx2(h,n,sp);
+#endif
+#if defined(__SSE2__)
+    return mem_casefind_sse2(h,n,sp);
+#else
+    return mem_casefind_scalar(h,n,0,sp);
+#endif
+}
+
+// 文档查找上下文：carry 为已扫描内容末尾不超过 m-1 字节，用于补查跨片段的匹配
+typedef struct {
+    const SearchPat *sp;
+    size_t found;
+    char carry[SEARCH_PAT_MAX*2];
+    size_t ncarry, carry_off;
+} DocFind;
+// 查找访问器：先查与上一片段拼接处，再查片段内部
+int doc_find_visit(const char *p, size_t n, size_t off, void *ctx) {
+    DocFind *f=(DocFind*)ctx;
+    size_t keep=f->sp->m-1;
+    if(f->ncarry) {
+        size_t k=n<keep?n:keep;
+        memcpy(f->carry+f->ncarry,p,k);
+        const char *r=mem_casefind(f->carry,f->ncarry+k,f->sp);
+        if(r&&(size_t)(r-f->carry)<f->ncarry) { f->found=f->carry_off+(r-f->carry); return 1; }
+    }
+    const char *r=mem_casefind(p,n,f->sp);
+    if(r) { f->found=off+(r-p); return 1; }
+    // 更新末尾字节：片段不足 m-1 字节时与原有内容衔接（carry 总是紧接在 off 之前）
+    if(n>=keep) { memcpy(f->carry,p+n-keep,keep); f->ncarry=keep; }
+    else {
+        size_t drop=f->ncarry+n>keep?f->ncarry+n-keep:0;
+        memmove(f->carry,f->carry+drop,f->ncarry-drop); f->ncarry-=drop;
+        memcpy(f->carry+f->ncarry,p,n); f->ncarry+=n;
+    }
+    f->carry_off=off+n-f->ncarry;
+    return 0;
+}
+// 查找起点在[from,to)内的第一个匹配，返回文档偏移，无匹配返回(size_t)-1
+size_t doc_find(const SearchPat *sp, size_t from, size_t to) {
+    size_t len=pt_length();
+    if(!sp->m) return from<to?from:(size_t)-1;
+    if(from>=to||from>=len) return (size_t)-1;
+    size_t end=to+sp->m-1<len?to+sp->m-1:len;
+    DocFind f; f.sp=sp; f.found=(size_t)-1; f.ncarry=0; f.carry_off=from;
+    pt_walk(pt_root,0,from,end,doc_find_visit,&f);
+    return f.found;
+}
+// 查找起点在[from,to)内的最后一个匹配：从to往前按块正向扫描，取块内最后一个
+size_t doc_find_last(const SearchPat *sp, size_t from, size_t to) {
+    size_t e=to;
+    while(e>from) {
+        size_t b=e-from>SEARCH_BLOCK?e-SEARCH_BLOCK:from, last=(size_t)-1, r;
+        for(size_t s=b;(r=doc_find(sp,s,e))!=(size_t)-1;s=r+1) last=r;
+        if(last!=(size_t)-1) return last;
+        e=b;
+    }
+    return (size_t)-1;
+}
+
+// ------------- 正则表达式 -------------
+// 模式先解析为语法树，再按 Thompson 构造编译为以字节为输入的 NFA：字符与字符类按 UTF-8 编码拆成字节区间序列。
+// 匹配时按需把 NFA 状态集合确定化为 DFA 状态并缓存其转移，每个字节一次查表，无回溯，时间与文本长度成线性；
+// 缓存状态过多时清空重建。匹配以行为单位：行首从允许 ^ 的起始状态开始，行尾额外输入一个虚拟的行尾符号以处理 $。
+// ASCII 字母不区分大小写，与 :f 一致。支持：字面字符 . [] [^] \d \w \s \D \W \S ( ) | * + ? {m,n} ^ $。
+// 模式开头的字面串先交给搜索内核定位候选行，只在候选行上运行 DFA；整个模式都是字面串时不需要 DFA。
+
+// NFA 节点类型
+enum { RE_BYTE, RE_SPLIT, RE_BOL, RE_EOL, RE_MATCH };
+// 语法树节点类型
+enum { RA_EMPTY, RA_SET, RA_CAT, RA_ALT, RA_REP, RA_BOL, RA_EOL };
+
+// 码点区间
+typedef struct { int lo, hi; } CpRange;
+// 语法树节点
+typedef struct ReAst {
+    int op;
+    struct ReAst *a, *b;     // 子节点
+    int min, max;            // RA_REP 次数，max<0 表示无上限
+    CpRange *set;            // RA_SET 码点区间（排序合并后）
+    int nset, set_cap;
+} ReAst;
+// NFA 节点：RE_BYTE 输入字节在[lo,hi]内时转到x；RE_SPLIT 同时转到x、y；RE_BOL/RE_EOL 断言后转到x
+typedef struct { unsigned char op, lo, hi; int x, y; } ReNode;
+// 编译后的模式
+typedef struct {
+    ReNode *node;
+    int count, cap;
+    int start;
+    int literal;             // 整个模式就是字面串，只用搜索内核
+    SearchPat prefix;        // 匹配必须以之开头的字面串（可能为空）
+} Regex;
+// 解析状态
+typedef struct {
+    const char *p;
+    const char *err;
+} ReParser;
+
+// DFA 状态：NFA 状态集合（升序）与按需计算的转移，-1 表示尚未计算
+typedef struct {
+    int *set, nset;
+    int accept;
+    int next[RE_SYM_EOL+1];
+} DfaState;
+// 惰性 DFA：每个线程各用一个，共享只读的 Regex
+typedef struct {
+    const Regex *re;
+    DfaState *st;
+    int count, cap;
+    int *ht, htcap;          // 状态集合→下标的开放寻址哈希表
+    int *list, *stack;       // 求闭包的工作区
+    unsigned *mark, gen;
+    int start;               // 行首起始状态，-1 表示尚未建立
+    unsigned epoch;          // 每次清空缓存加一
+} Dfa;
+
+// 新建语法树节点
+ReAst *ast_new(int op, ReAst *a, ReAst *b) {
+    ReAst *n=(ReAst*)calloc(1,sizeof(ReAst));
+    n->op=op; n->a=a; n->b=b;
+    return n;
+}
+// 释放语法树
+void ast_free(ReAst *n) {
+    if(!n) return;
+    ast_free(n->a); ast_free(n->b);
+    free(n->set); free(n);
+}
+// 向字符类加入码点区间（不排序）
+void set_push(ReAst *n, int lo, int hi) {
+    if(n->nset==n->set_cap) { n->set_cap=n->set_cap?n->set_cap*2:8; n->set=(CpRange*)realloc(n->set,n->set_cap*sizeof(CpRange)); }
+    n->set[n->nset].lo=lo; n->set[n->nset].hi=hi; n->nset++;
+}
+// 加入区间，其中的ASCII字母同时加入另一种大小写
+void set_add(ReAst *n, int lo, int hi) {
+    set_push(n,lo,hi);
+    int a=lo>'a'?lo:'a', b=hi<'z'?hi:'z';
+    if(a<=b) set_push(n,a-32,b-32);
+    a=lo>'A'?lo:'A'; b=hi<'Z'?hi:'Z';
+    if(a<=b) set_push(n,a+32,b+32);
+}
+int cprange_cmp(const void *a, const void *b) { return ((const CpRange*)a)->lo-((const CpRange*)b)->lo; }
+// 排序并合并相邻/重叠区间
+void set_normalize(ReAst *n) {
+    if(!n->nset) return;
+    qsort(n->set,n->nset,sizeof(CpRange),cprange_cmp);
+    int k=0;
+    for(int i=1;i<n->nset;i++) {
+        if(n->set[i].lo<=n->set[k].hi+1) { if(n->set[i].hi>n->set[k].hi) n->set[k].hi=n->set[i].hi; }
+        else n->set[++k]=n->set[i];
+    }
+    n->nset=k+1;
+}
+// 取补集（换行不在任何字符类中）
+void set_negate(ReAst *n) {
+    set_normalize(n);
+    CpRange *old=n->set; int nold=n->nset, lo=0;
+    n->set=NULL; n->nset=n->set_cap=0;
+    for(int i=0;i<nold;i++) { if(old[i].lo>lo) set_push(n,lo,old[i].lo-1); lo=old[i].hi+1; }
+    if(lo<=0x10FFFF) set_push(n,lo,0x10FFFF);
+    free(old);
+    CpRange *cur=n->set; int ncur=n->nset;
+    n->set=NULL; n->nset=n->set_cap=0;
+    for(int i=0;i<ncur;i++) {
+        if(cur[i].lo<='\n'&&cur[i].hi>='\n') {
+            if(cur[i].lo<'\n') set_push(n,cur[i].lo,'\n'-1);
+            if(cur[i].hi>'\n') set_push(n,'\n'+1,cur[i].hi);
+        } else set_push(n,cur[i].lo,cur[i].hi);
+    }
+    free(cur);
+}
+// \d \w \s 及其大写取反形式加入字符类，不是类转义时返回0
+int re_class_escape(int c, ReAst *n) {
+    ReAst t={0};
+    int lc=c|0x20;
+    if(lc=='d') set_push(&t,'0','9');
+    else if(lc=='w') { set_push(&t,'0','9'); set_push(&t,'A','Z'); set_push(&t,'a','z'); set_push(&t,'_','_'); }
+    else if(lc=='s') { set_push(&t,'\t','\t'); set_push(&t,'\v','\r'); set_push(&t,' ',' '); }
+    else return 0;
+    if(c!=lc) set_negate(&t);
+    for(int i=0;i<t.nset;i++) set_push(n,t.set[i].lo,t.set[i].hi);
+    free(t.set);
+    return 1;
+}
+// 转义后的普通字符
+int re_escape_char(int c) { return c=='t'?'\t':c=='n'?'\n':c=='r'?'\r':c; }
+
+ReAst *re_parse_alt(ReParser *ps);
+// 解析 [...]
+ReAst *re_parse_class(ReParser *ps) {
+    ReAst *n=ast_new(RA_SET,NULL,NULL);
+    int neg=0;
+    if(*ps->p=='^') { neg=1; ps->p++; }
+    int first=1;
+    while(*ps->p&&(*ps->p!=']'||first)) {
+        int lo, hi;
+        first=0;
+        if(*ps->p=='\\'&&ps->p[1]) {
+            ps->p++;
+            if(re_class_escape((unsigned char)*ps->p,n)) { ps->p++; continue; }
+            lo=re_escape_char((unsigned char)*ps->p++);
+        } else ps->p+=utf8_decode(ps->p,&lo);
+        hi=lo;
+        if(ps->p[0]=='-'&&ps->p[1]&&ps->p[1]!=']') {
+            ps->p++;
+            if(*ps->p=='\\'&&ps->p[1]) { ps->p++; hi=re_escape_char((unsigned char)*ps->p++); }
+            else ps->p+=utf8_decode(ps->p,&hi);
+            if(hi<lo) { ps->err="字符类区间颠倒"; return n; }
+        }
+        set_add(n,lo,hi);
+    }
+    if(*ps->p!=']') { ps->err="缺少 ]"; return n; }
+    ps->p++;
+    if(neg) set_negate(n); else set_normalize(n);
+    return n;
+}
+// 解析原子：字符、转义、.、字符类、分组、^、$
+ReAst *re_parse_atom(ReParser *ps) {
+    int c=(unsigned char)*ps->p;
+    if(c=='(') {
+        ps->p++;
+        if(ps->p[0]=='?'&&ps->p[1]==':') ps->p+=2;
+        ReAst *n=re_parse_alt(ps);
+        if(*ps->p!=')') { if(!ps->err) ps->err="缺少 )"; return n; }
+        ps->p++;
+        return n;
+    }
+    if(c=='[') { ps->p++; return re_parse_class(ps); }
+    if(c=='^') { ps->p++; return ast_new(RA_BOL,NULL,NULL); }
+    if(c=='$') { ps->p++; return ast_new(RA_EOL,NULL,NULL); }
+    ReAst *n=ast_new(RA_SET,NULL,NULL);
+    if(c=='.') { ps->p++; set_push(n,0,'\n'-1); set_push(n,'\n'+1,0x10FFFF); return n; }
+    if(c=='\\') {
+        ps->p++;
+        if(!*ps->p) { ps->err="末尾的 \\"; return n; }
+        if(re_class_escape((unsigned char)*ps->p,n)) { ps->p++; set_normalize(n); return n; }
+        c=re_escape_char((unsigned char)*ps->p++);
+    } else if(c=='*'||c=='+'||c=='?'||(c=='{'&&isdigit((unsigned char)ps->p[1]))) { ps->err="重复符号前没有内容"; return n; }
+    else ps->p+=utf8_decode(ps->p,&c);
+    set_add(n,c,c); set_normalize(n);
+    return n;
+}
+// 解析原子及其后的重复符号
+ReAst *re_parse_repeat(ReParser *ps) {
+    ReAst *n=re_parse_atom(ps);
+    while(!ps->err) {
+        int c=*ps->p, min, max;
+        if(c=='*') { min=0; max=-1; ps->p++; }
+        else if(c=='+') { min=1; max=-1; ps->p++; }
+        else if(c=='?') { min=0; max=1; ps->p++; }
+        else if(c=='{'&&isdigit((unsigned char)ps->p[1])) {
+            char *e; min=(int)strtol(ps->p+1,&e,10); max=min;
+            if(*e==',') { e++; max=isdigit((unsigned char)*e)?(int)strtol(e,&e,10):-1; }
+            if(*e!='}') { ps->err="{m,n} 格式错误"; break; }
+            if(min>RE_REP_MAX||max>RE_REP_MAX||(max>=0&&max<min)) { ps->err="重复次数超出范围"; break; }
+            ps->p=e+1;
+        } else break;
+        ReAst *r=ast_new(RA_REP,n,NULL);
+        r->min=min; r->max=max; n=r;
+    }
+    return n;
+}
+// 解析连接
+ReAst *re_parse_cat(ReParser *ps) {
+    ReAst *n=ast_new(RA_EMPTY,NULL,NULL);
+    while(!ps->err&&*ps->p&&*ps->p!='|'&&*ps->p!=')') n=ast_new(RA_CAT,n,re_parse_repeat(ps));
+    return n;
+}
+// 解析选择
+ReAst *re_parse_alt(ReParser *ps) {
+    ReAst *n=re_parse_cat(ps);
+    while(!ps->err&&*ps->p=='|') { ps->p++; n=ast_new(RA_ALT,n,re_parse_cat(ps)); }
+    return n;
 }
 
-// 向后查找
-int search_pat(const char *pattern, int start) {
-    for(int i=start;i<line_count;i++) if(strcasestr2(lines[i],pattern)) return i;
-    for(int i=0;i<start;i++) if(strcasestr2(lines[i],pattern)) return i;
+// 新建NFA节点，返回下标；超出上限时返回-1
+int re_node(Regex *re, int op, int lo, int hi, int x, int y) {
+    if(re->count>=RE_MAX_NODES) return -1;
+    if(re->count==re->cap) { re->cap=re->cap?re->cap*2:64; re->node=(ReNode*)realloc(re->node,re->cap*sizeof(ReNode)); }
+    ReNode *n=&re->node[re->count];
+    n->op=(unsigned char)op; n->lo=(unsigned char)lo; n->hi=(unsigned char)hi; n->x=x; n->y=y;
+    return re->count++;
+}
+// 两个分支合为一个起点
+int re_split(Regex *re, int a, int b) {
+    if(a<0||b<0) return -1;
+    return re_node(re,RE_SPLIT,0,0,a,b);
+}
+// 把码点区间[lo,hi]编译为若干UTF-8字节区间序列，各序列接到next，返回合并后的起点
+int re_utf8_range(Regex *re, int lo, int hi, int next) {
+    static const int maxcp[3]={0x7F,0x7FF,0xFFFF};
+    for(int k=0;k<3;k++)
+        if(lo<=maxcp[k]&&hi>maxcp[k]) return re_split(re,re_utf8_range(re,lo,maxcp[k],next),re_utf8_range(re,maxcp[k]+1,hi,next));
+    if(hi<0x80) return re_node(re,RE_BYTE,lo,hi,next,0);
+    int n=hi<0x800?2:hi<0x10000?3:4;
+    for(int i=1;i<n;i++) {
+        int m=(1<<(6*i))-1;
+        if((lo&~m)!=(hi&~m)) {
+            if(lo&m) return re_split(re,re_utf8_range(re,lo,lo|m,next),re_utf8_range(re,(lo|m)+1,hi,next));
+            if((hi&m)!=m) return re_split(re,re_utf8_range(re,lo,(hi&~m)-1,next),re_utf8_range(re,hi&~m,hi,next));
+        }
+    }
+    char a[4], b[4];
+    utf8_encode(lo,a); utf8_encode(hi,b);
+    int cur=next;
+    for(int i=n-1;i>=0&&cur>=0;i--) cur=re_node(re,RE_BYTE,(unsigned char)a[i],(unsigned char)b[i],cur,0);
+    return cur;
+}
+// 把语法树编译为接到next的NFA片段，返回起点；失败返回-1
+int re_compile_ast(Regex *re, const ReAst *n, int next) {
+    if(next<0) return -1;
+    switch(n->op) {
+    case RA_EMPTY: return next;
+    case RA_BOL: return re_node(re,RE_BOL,0,0,next,0);
+    case RA_EOL: return re_node(re,RE_EOL,0,0,next,0);
+    case RA_CAT: return re_compile_ast(re,n->a,re_compile_ast(re,n->b,next));
+    case RA_ALT: { int a=re_compile_ast(re,n->a,next); return re_split(re,a,re_compile_ast(re,n->b,next)); }
+    case RA_SET: {
+        if(!n->nset) return re_node(re,RE_BYTE,1,0,next,0);   // 空集：永不匹配
+        int cur=re_utf8_range(re,n->set[0].lo,n->set[0].hi,next);
+        for(int i=1;i<n->nset;i++) cur=re_split(re,cur,re_utf8_range(re,n->set[i].lo,n->set[i].hi,next));
+        return cur;
+    }
+    case RA_REP: {
+        int cur=next;
+        if(n->max<0) {
+            int s=re_node(re,RE_SPLIT,0,0,-1,next);
+            if(s<0) return -1;
+            int body=re_compile_ast(re,n->a,s);
+            if(body<0) return -1;
+            re->node[s].x=body; cur=s;
+        } else for(int i=n->min;i<n->max&&cur>=0;i++) cur=re_split(re,re_compile_ast(re,n->a,cur),next);
+        for(int i=0;i<n->min&&cur>=0;i++) cur=re_compile_ast(re,n->a,cur);
+        return cur;
+    }
+    }
     return -1;
 }
-// 向前查找
-int search_pat_rev(const char *pattern, int start) {
-    for(int i=start;i>=0;i--) if(strcasestr2(lines[i],pattern)) return i;
-    for(int i=line_count-1;i>start;i--) if(strcasestr2(lines[i],pattern)) return i;
+// 字符类是否只含一个字符（ASCII字母含大小写两种），是则返回其小写码点，否则返回-1
+int set_single(const ReAst *n) {
+    if(n->nset==1&&n->set[0].lo==n->set[0].hi) return n->set[0].lo;
+    if(n->nset==2&&n->set[0].lo==n->set[0].hi&&n->set[1].lo==n->set[1].hi&&
+       n->set[0].lo>='A'&&n->set[0].lo<='Z'&&n->set[1].lo==n->set[0].lo+32) return n->set[1].lo;
     return -1;
 }
+// 按顺序收集顶层连接的各项
+void ast_flatten(const ReAst *n, const ReAst **items, int *count, int max) {
+    if(n->op==RA_CAT) { ast_flatten(n->a,items,count,max); ast_flatten(n->b,items,count,max); }
+    else if(n->op!=RA_EMPTY&&*count<max) items[(*count)++]=n;
+}
+// 提取字面前缀；整个模式为字面串时置 literal
+void re_extract_prefix(Regex *re, const ReAst *root) {
+    const ReAst *items[SEARCH_PAT_MAX+1]; int count=0, i=0;
+    char pre[SEARCH_PAT_MAX+1]; int len=0;
+    ast_flatten(root,items,&count,SEARCH_PAT_MAX+1);
+    int bol=count&&items[0]->op==RA_BOL;
+    if(bol) i=1;
+    for(;i<count;i++) {
+        if(items[i]->op!=RA_SET) break;
+        int c=set_single(items[i]);
+        char u[4]; int k=c<0?0:utf8_encode(c,u);
+        if(c<0||c=='\n'||len+k>SEARCH_PAT_MAX) break;
+        memcpy(pre+len,u,k); len+=k;
+    }
+    pre[len]=0;
+    search_pat_init(&re->prefix,pre);
+    re->literal=!bol&&i==count&&count<=SEARCH_PAT_MAX;
+}
+// 释放编译结果
+void regex_free(Regex *re) { free(re->node); memset(re,0,sizeof(*re)); }
+// 字面串查找也用 Regex 表示
+void regex_literal(Regex *re, const char *pat) {
+    memset(re,0,sizeof(*re));
+    search_pat_init(&re->prefix,pat);
+    re->literal=1;
+}
+// 编译正则表达式；失败时返回0并通过err给出原因
+int regex_compile(Regex *re, const char *pat, const char **err) {
+    memset(re,0,sizeof(*re));
+    ReParser ps={pat,NULL};
+    ReAst *root=re_parse_alt(&ps);
+    if(!ps.err&&*ps.p) ps.err="多余的 )";
+    if(!ps.err) {
+        int match=re_node(re,RE_MATCH,0,0,0,0);
+        re->start=re_compile_ast(re,root,match);
+        if(re->start<0) ps.err="正则表达式过大";
+        else re_extract_prefix(re,root);
+    }
+    ast_free(root);
+    if(ps.err) { regex_free(re); *err=ps.err; return 0; }
+    return 1;
+}
+
+// 初始化惰性DFA
+void dfa_init(Dfa *d, const Regex *re) {
+    memset(d,0,sizeof(*d));
+    d->re=re; d->start=-1;
+    if(!re->literal) {
+        d->list=(int*)malloc(re->count*sizeof(int));
+        d->stack=(int*)malloc(re->count*sizeof(int));
+        d->mark=(unsigned*)calloc(re->count,sizeof(unsigned));
+    }
+}
+// 清空已缓存的状态
+void dfa_flush(Dfa *d) {
+    for(int i=0;i<d->count;i++) free(d->st[i].set);
+    d->count=0; d->start=-1; d->epoch++;
+    if(d->ht) memset(d->ht,-1,d->htcap*sizeof(int));
+}
+// 释放DFA
+void dfa_free(Dfa *d) {
+    dfa_flush(d);
+    free(d->st); free(d->ht); free(d->list); free(d->stack); free(d->mark);
+    memset(d,0,sizeof(*d));
+}
+// 开始新一轮闭包计算
+void dfa_newgen(Dfa *d) {
+    if(++d->gen==0) { memset(d->mark,0,d->re->count*sizeof(unsigned)); d->gen=1; }
+}
+// 把node的ε闭包加入工作集合（bol 表示处于行首，可越过 ^）
+void dfa_closure(Dfa *d, int node, int bol, int *n) {
+    const ReNode *nd=d->re->node;
+    int sp=0;
+    if(d->mark[node]==d->gen) return;
+    d->mark[node]=d->gen; d->stack[sp++]=node;
+    while(sp) {
+        int k=d->stack[--sp];
+        switch(nd[k].op) {
+        case RE_SPLIT:
+            if(d->mark[nd[k].y]!=d->gen) { d->mark[nd[k].y]=d->gen; d->stack[sp++]=nd[k].y; }
+            if(d->mark[nd[k].x]!=d->gen) { d->mark[nd[k].x]=d->gen; d->stack[sp++]=nd[k].x; }
+            break;
+        case RE_BOL:
+            if(bol&&d->mark[nd[k].x]!=d->gen) { d->mark[nd[k].x]=d->gen; d->stack[sp++]=nd[k].x; }
+            break;
+        default: d->list[(*n)++]=k;
+        }
+    }
+}
+int int_cmp(const void *a, const void *b) { return *(const int*)a-*(const int*)b; }
+// 工作集合对应的DFA状态下标，没有则新建（状态数到上限时先清空缓存）
+int dfa_intern(Dfa *d, int n) {
+    qsort(d->list,n,sizeof(int),int_cmp);
+    unsigned h=2166136261u;
+    for(int i=0;i<n;i++) h=(h^(unsigned)d->list[i])*16777619u;
+    if(d->ht) for(unsigned i=h&(d->htcap-1);d->ht[i]>=0;i=(i+1)&(d->htcap-1)) {
+        DfaState *s=&d->st[d->ht[i]];
+        if(s->nset==n&&!memcmp(s->set,d->list,n*sizeof(int))) return d->ht[i];
+    }
+    if(d->count>=DFA_MAX_STATES) dfa_flush(d);
+    if(d->count==d->cap) { d->cap=d->cap?d->cap*2:64; d->st=(DfaState*)realloc(d->st,d->cap*sizeof(DfaState)); }
+    if((d->count+1)*2>d->htcap) {
+        d->htcap=d->htcap?d->htcap*2:128;
+        d->ht=(int*)realloc(d->ht,d->htcap*sizeof(int));
+        memset(d->ht,-1,d->htcap*sizeof(int));
+        for(int k=0;k<d->count;k++) {
+            unsigned g=2166136261u;
+            for(int i=0;i<d->st[k].nset;i++) g=(g^(unsigned)d->st[k].set[i])*16777619u;
+            unsigned i=g&(d->htcap-1);
+            while(d->ht[i]>=0) i=(i+1)&(d->htcap-1);
+            d->ht[i]=k;
+        }
+    }
+    DfaState *s=&d->st[d->count];
+    s->set=(int*)malloc((n?n:1)*sizeof(int)); memcpy(s->set,d->list,n*sizeof(int)); s->nset=n;
+    s->accept=0;
+    for(int i=0;i<n;i++) if(d->re->node[d->list[i]].op==RE_MATCH) s->accept=1;
+    memset(s->next,-1,sizeof(s->next));
+    unsigned i=h&(d->htcap-1);
+    while(d->ht[i]>=0) i=(i+1)&(d->htcap-1);
+    d->ht[i]=d->count;
+    return d->count++;
+}
+// 行首起始状态
+int dfa_start(Dfa *d) {
+    if(d->start<0) { int n=0; dfa_newgen(d); dfa_closure(d,d->re->start,1,&n); d->start=dfa_intern(d,n); }
+    return d->start;
+}
+// 计算并缓存状态s输入sym（字节或 RE_SYM_EOL）后的状态；除行尾外每步都并入起始闭包，即在任意位置开始匹配
+int dfa_step(Dfa *d, int s, int sym) {
+    int n=0;
+    dfa_newgen(d);
+    for(int i=0;i<d->st[s].nset;i++) {
+        const ReNode *nd=&d->re->node[d->st[s].set[i]];
+        if(sym<RE_SYM_EOL?nd->op==RE_BYTE&&nd->lo<=sym&&sym<=nd->hi:nd->op==RE_EOL) dfa_closure(d,nd->x,0,&n);
+    }
+    if(sym<RE_SYM_EOL) dfa_closure(d,d->re->start,0,&n);
+    unsigned epoch=d->epoch;
+    int t=dfa_intern(d,n);
+    if(d->epoch==epoch) d->st[s].next[sym]=t;
+    return t;
+}
+
+// 按行运行DFA的扫描状态
+typedef struct {
+    Dfa *d;
+    int cur, skip, line;     // 当前状态，本行已匹配（跳到行尾），当前行号
+    int **out, *count, *cap;
+    int bol;                 // 当前行尚未开始：见到本行的字节（或扫到文档末尾）时才开始，不越出范围
+    int cr;                  // 只读查看时片段以 \r 结尾，要看下一字节才知道它是不是行尾
+} ReScan;
+// 记录匹配行
+void match_push(int **out, int *count, int *cap, int line) {
+    if(*count==*cap) { *cap=*cap?*cap*2:256; *out=(int*)realloc(*out,*cap*sizeof(int)); }
+    (*out)[(*count)++]=line;
+}
+// 进入新的一行
+void re_scan_bol(ReScan *s) {
+    s->cur=dfa_start(s->d); s->skip=0;
+    if(s->d->st[s->cur].accept) { match_push(s->out,s->count,s->cap,s->line); s->skip=1; }
+}
+// 扫描访问器：逐字节查表转移，行内一旦接受即跳到行尾
+int re_scan_visit(const char *p, size_t n, size_t off, void *ctx) {
+    ReScan *s=(ReScan*)ctx;
+    const char *e=p+n;
+    while(p<e) {
+        if(s->bol) { s->bol=0; re_scan_bol(s); }
+        if(s->skip) {
+            const char *nl=(const char*)memchr(p,'\n',e-p);
+            if(!nl) return 0;
+            p=nl+1; s->line++; s->bol=1;
+            continue;
+        }
+        // 行内的转移放在局部变量里走，换行、接受或片段结束时才写回；
+        // 只读查看不归一化 \r\n（同 line_slot），行尾的 \r 不送入DFA
+        Dfa *d=s->d;
+        int cur=s->cur;
+        if(s->cr) {
+            s->cr=0;
+            if(*p!='\n') { int t=d->st[cur].next['\r']; cur=t>=0?t:dfa_step(d,cur,'\r'); }
+        }
+        while(!d->st[cur].accept&&p<e&&*p!='\n') {
+            unsigned char c=(unsigned char)*p;
+            if(c=='\r'&&view_mode) {
+                if(p+1==e) { s->cr=1; break; }
+                if(p[1]=='\n') { p++; break; }
+            }
+            p++;
+            int t=d->st[cur].next[c];
+            cur=t>=0?t:dfa_step(d,cur,c);
+        }
+        s->cur=cur;
+        if(d->st[cur].accept) { match_push(s->out,s->count,s->cap,s->line); s->skip=1; continue; }
+        if(s->cr) return 0;
+        if(p==e) return 0;
+        p++;
+        int t=d->st[cur].next[RE_SYM_EOL];
+        if(t<0) t=dfa_step(d,cur,RE_SYM_EOL);
+        if(d->st[t].accept) match_push(s->out,s->count,s->cap,s->line);
+        s->line++; s->bol=1;
+    }
+    return 0;
+}
+// 在[from,to)（from为第line行行首，to为行首或超出文档末尾）上运行DFA，把含匹配的行号追加到*out
+void re_scan(Dfa *d, int line, size_t from, size_t to, int **out, int *count, int *cap) {
+    size_t len=pt_length();
+    ReScan s={d,0,0,line,out,count,cap,1,0};
+    pt_walk(pt_root,0,from,to<len?to:len,re_scan_visit,&s);
+    if(to<=len) return;
+    if(s.bol) re_scan_bol(&s);  // 文档末尾的空行
+    if(!s.skip) {
+        int t=d->st[s.cur].next[RE_SYM_EOL];
+        if(t<0) t=dfa_step(d,s.cur,RE_SYM_EOL);
+        if(d->st[t].accept) match_push(out,count,cap,s.line);
+    }
+}
+
+// ------------- 匹配索引 -------------
+// :f/:fr 时把文档按行分块交给多个线程，各自找出含匹配的行，拼接成升序行号索引；之后 n/N 只需二分。
+// 编辑时只重扫被改动的行，其后的行号随增删的行数平移，索引始终与文档一致。
 
-// 光标左移
-int move_cx_left(const char *s, int cx) {
-    if (cx <= 0) return 0;
-    int prev_cx = 0, i = 0, last_cx = 0;
-    while (s[i]) {
-        int w = char_width(s, i);
-        int clen = utf8_len((unsigned char)s[i]);
-        if (prev_cx + w >= cx) break;
-        prev_cx += w;
-        i += clen;
-        last_cx = prev_cx;
+Regex match_re;                     // 索引对应的已编译模式
+Dfa match_dfa;                      // 主线程维护索引用的DFA
+
+// 查找[from,to)（from为行首）内所有含匹配的行号，追加到*out：有字面前缀时先用搜索内核定位候选行，
+// 字面模式直接记录，否则只在候选行上运行DFA；没有前缀时DFA扫描整个区间
+void match_scan(const Regex *re, Dfa *d, size_t from, size_t to, int **out, int *count, int *cap) {
+    if(!re->literal&&!re->prefix.m) { re_scan(d,(int)pt_line_of(from),from,to,out,count,cap); return; }
+    size_t r;
+    while(from<to&&(r=doc_find(&re->prefix,from,to))!=(size_t)-1) {
+        int ln=(int)pt_line_of(r);
+        if(re->literal) match_push(out,count,cap,ln);
+        else re_scan(d,ln,line_off(ln),ln+1<line_count?line_off(ln+1):pt_length()+1,out,count,cap);
+        if(ln+1>=line_count) break;
+        from=line_off(ln+1);
+    }
+}
+// 建立索引的分块任务：扫描[first,last)行，各用一个DFA
+typedef struct {
+    int first, last;
+    int *lines, count, cap;
+} MatchJob;
+void match_worker(void *arg) {
+    MatchJob *j=(MatchJob*)arg;
+    size_t to=j->last<line_count?line_off(j->last):pt_length()+1;
+    Dfa d; dfa_init(&d,&match_re);
+    match_scan(&match_re,&d,line_off(j->first),to,&j->lines,&j->count,&j->cap);
+    dfa_free(&d);
+}
+// 为pattern建立匹配索引（regex 表示按正则表达式）：大文档按处理器数分块并行扫描；
+// 正则有误时返回0，err给出原因，原索引不变
+int match_index_build(const char *pattern, int regex, const char **err) {
+    Regex re;
+    if(!regex) regex_literal(&re,pattern);
+    else if(!regex_compile(&re,pattern,err)) return 0;
+    dfa_free(&match_dfa); regex_free(&match_re);
+    match_re=re; dfa_init(&match_dfa,&match_re);
+    search_kernel_init();
+    int n=1;
+    if(pt_length()>=SEARCH_PAR_MIN) {
+        n=cpu_count();
+        if(n>SEARCH_MAX_THREADS) n=SEARCH_MAX_THREADS;
+        if(n>line_count) n=line_count;
+        if(n<1) n=1;
+    }
+    MatchJob jobs[SEARCH_MAX_THREADS]; thread_t th[SEARCH_MAX_THREADS]; int started[SEARCH_MAX_THREADS]={0};
+    for(int i=0;i<n;i++) {
+        jobs[i].lines=NULL; jobs[i].count=jobs[i].cap=0;
+        jobs[i].first=(int)((long long)line_count*i/n); jobs[i].last=(int)((long long)line_count*(i+1)/n);
+    }
+    for(int i=1;i<n;i++) {
+        started[i]=thread_start(&th[i],match_worker,&jobs[i]);
+        if(!started[i]) match_worker(&jobs[i]);
+    }
+    match_worker(&jobs[0]);
+    match_count=0;
+    for(int i=0;i<n;i++) {
+        if(started[i]) thread_join(th[i]);
+        if(match_count+jobs[i].count>match_cap) {
+            while(match_count+jobs[i].count>match_cap) match_cap=match_cap?match_cap*2:256;
+            match_lines=(int*)realloc(match_lines,match_cap*sizeof(int));
+        }
+        if(jobs[i].count) memcpy(match_lines+match_count,jobs[i].lines,jobs[i].count*sizeof(int));
+        match_count+=jobs[i].count; free(jobs[i].lines);
     }
-    return last_cx;
+    if(view_mode&&orig_buf.mapped) file_drop(orig_buf.data,orig_buf.len);  // 只读查看：扫过的页不常驻
+    strncpy(match_pat,pattern,127); match_pat[127]=0;
+    match_regex=regex; match_valid=1;
+    return 1;
+}
+// 确保索引对应pattern；正则有误时索引为空
+void match_index_ensure(const char *pattern, int regex) {
+    const char *err;
+    if(match_valid&&match_regex==regex&&!strcmp(match_pat,pattern)) return;
+    if(!match_index_build(pattern,regex,&err)) match_count=0;
+}
+// 索引中第一个不小于line的下标
+int match_lower(int line) {
+    int lo=0, hi=match_count;
+    while(lo<hi) { int mid=lo+(hi-lo)/2; if(match_lines[mid]<line) lo=mid+1; else hi=mid; }
+    return lo;
+}
+// line在索引中的序号（从1起），不含匹配时返回0
+int match_rank(int line) {
+    int k=match_lower(line);
+    return k<match_count&&match_lines[k]==line?k+1:0;
 }
+// 编辑后维护索引：first行起的removed+1行变为added+1行，重扫这些行，其后的行号平移
+void match_index_edit(int first, int removed, int added) {
+    if(!match_valid) return;
+    int lo=match_lower(first), hi=match_lower(first+removed+1), delta=added-removed;
+    int *fresh=NULL, nf=0, capf=0;
+    size_t to=first+added+1<line_count?line_off(first+added+1):pt_length()+1;
+    match_scan(&match_re,&match_dfa,line_off(first),to,&fresh,&nf,&capf);
+    int tail=match_count-hi, need=lo+nf+tail;
+    if(need>match_cap) { while(need>match_cap) match_cap=match_cap?match_cap*2:256; match_lines=(int*)realloc(match_lines,match_cap*sizeof(int)); }
+    memmove(match_lines+lo+nf,match_lines+hi,tail*sizeof(int));
+    if(nf) memcpy(match_lines+lo,fresh,nf*sizeof(int));
+    if(delta) for(int k=lo+nf;k<need;k++) match_lines[k]+=delta;
+    match_count=need;
+    free(fresh);
+}
+
+// 向后查找：从第start行起找第一个含匹配的行，到末尾后从头回绕
+int search_pat(const char *pattern, int regex, int start) {
+    match_index_ensure(pattern,regex);
+    if(!match_count) return -1;
+    int k=match_lower(start);
+    return match_lines[k<match_count?k:0];
+}
+// 向前查找：从第start行往前找最后一个含匹配的行，到开头后从末尾回绕
+int search_pat_rev(const char *pattern, int regex, int start) {
+    match_index_ensure(pattern,regex);
+    if(!match_count) return -1;
+    int k=match_lower(start+1)-1;
+    return match_lines[k>=0?k:match_count-1];
+}
+
+// ------------- 替换 -------------
+// :[范围]s/查找/替换/[gi]：先按行分块并行找出所有匹配（各线程按 SEARCH_BLOCK 大小整行读出，用搜索内核扫描），
+// 再把相距不到 SUBST_GAP 字节的匹配合成一段，每段读出一次、拼出新内容后整段替换。
+// 整次替换记为一个撤销组，编辑次数最多为匹配数与文档大小/SUBST_GAP 中较小者。
+
+// 解析后的替换命令
+typedef struct {
+    int first, last;         // 行范围 [first,last)
+    char pat[SEARCH_PAT_MAX+1];
+    char rep[256];           // 替换内容，'\0' 处代入匹配到的原文（&）
+    size_t m, nrep, namp;    // 查找串长度 / 替换内容长度 / 其中 & 的个数
+    int global, fold;        // g：每行替换所有匹配 / i：忽略ASCII大小写
+} Subst;
+// 一个分块的扫描任务：找出[first,last)行内的匹配起点
+typedef struct {
+    const Subst *s;
+    const SearchPat *sp;
+    int first, last;
+    size_t *hits, count, cap;
+    int lines;               // 含匹配的行数
+} SubstJob;
 
-// 光标右移
-int move_cx_right(const char *s, int cx) {
-    int i = 0, cur_cx = 0;
-    while (s[i]) {
-        int w = char_width(s, i);
-        int clen = utf8_len((unsigned char)s[i]);
-        if (cur_cx == cx) return cur_cx + w;
-        cur_cx += w;
-        i += clen;
+// 解析行号：数字（从1起）、. 当前行、$ 末行；返回其后的位置，不是行号时返回NULL
+const char *subst_line(const char *p, int *line) {
+    if(*p=='.') { *line=cy; return p+1; }
+    if(*p=='$') { *line=line_count-1; return p+1; }
+    if(*p<'0'||*p>'9') return NULL;
+    long v=0;
+    while(*p>='0'&&*p<='9') { if(v<100000000) v=v*10+(*p-'0'); p++; }
+    *line=(int)(v>0?v-1:0);
+    return p;
+}
+// 读出以 delim 结尾的一段，\delim 与 \\ 转义；rep 为真时 & 记为 '\0'，\n、\t 为换行、制表符，\& 为 &。
+// 返回结束符之后的位置（没有结束符时为末尾），出错返回NULL
+const char *subst_part(const char *p, char delim, int rep, char *out, size_t cap, size_t *len, size_t *namp) {
+    size_t n=0;
+    for(;*p&&*p!=delim;p++) {
+        char c=*p;
+        if(c=='\\'&&p[1]) {
+            c=*++p;
+            if(rep&&c=='n') c='\n';
+            else if(rep&&c=='t') c='\t';
+            else if(c!=delim&&c!='\\'&&!(rep&&c=='&')) { if(n+1>=cap) return NULL; out[n++]='\\'; }
+        } else if(rep&&c=='&') { c=0; (*namp)++; }
+        if(n+1>=cap) return NULL;
+        out[n++]=c;
+    }
+    *len=n;
+    return *p?p+1:p;
+}
+// 解析 :[范围]s/查找/替换/[gi]，范围可为空（当前行）、%、行号或 行号,行号；不是替换命令时返回0
+int subst_parse(const char *cmd, Subst *s, const char **err) {
+    const char *p=cmd, *q;
+    int a=cy, b=cy;
+    *err=NULL;
+    if(*p=='%') { a=0; b=line_count-1; p++; }
+    else if((q=subst_line(p,&a))) {
+        b=a; p=q;
+        if(*p==',') { if(!(q=subst_line(p+1,&b))) return 0; p=q; }
+    }
+    if(p[0]!='s'||!p[1]||(p[1]|32)-'a'<26u||(unsigned char)(p[1]-'0')<10||p[1]==' '||p[1]=='\\'||(unsigned char)p[1]>=0x80) return 0;
+    char delim=p[1];
+    s->namp=0; s->global=s->fold=0;
+    p=subst_part(p+2,delim,0,s->pat,sizeof(s->pat),&s->m,&s->namp);
+    if(!p) { *err="查找内容过长"; return 1; }
+    p=subst_part(p,delim,1,s->rep,sizeof(s->rep),&s->nrep,&s->namp);
+    if(!p) { *err="替换内容过长"; return 1; }
+    for(;*p;p++) {
+        if(*p=='g') s->global=1;
+        else if(*p=='i') s->fold=1;
+        else { *err="不支持的替换选项（只支持 g、i）"; return 1; }
+    }
+    if(!s->m) *err="查找内容为空";
+    else if(memchr(s->pat,'\n',s->m)) *err="查找内容不能跨行";
+    if(a>b) { int t=a; a=b; b=t; }
+    s->first=a<line_count?a:line_count-1; s->last=b<line_count?b+1:line_count;
+    return 1;
+}
+// 在连续内存buf[0,n)（从文档偏移off起，由整行组成）中查找匹配，起点追加到任务的结果
+void subst_scan(SubstJob *j, const char *buf, size_t n, size_t off) {
+    const Subst *s=j->s;
+    const char *p=buf, *e=buf+n, *r;
+    size_t before=j->count;
+    while(p<e&&(r=mem_casefind(p,e-p,j->sp))) {
+        if(!s->fold&&memcmp(r,s->pat,s->m)) { p=r+1; continue; }
+        if(j->count==j->cap) { j->cap=j->cap?j->cap*2:1024; j->hits=(size_t*)realloc(j->hits,j->cap*sizeof(size_t)); }
+        // 块由整行组成，块内第一个匹配总在新的一行；不带 g 时每个匹配后都跳到下一行，各占一行
+        if(j->count==before||!s->global||memchr(p,'\n',r-p)) j->lines++;
+        j->hits[j->count++]=off+(r-buf);
+        p=r+s->m;
+        if(!s->global) { const char *nl=(const char*)memchr(p,'\n',e-p); if(!nl) break; p=nl+1; }
+    }
+}
+// 扫描线程：按不超过 SEARCH_BLOCK 字节（至少一行）整行读出后查找
+void subst_worker(void *arg) {
+    SubstJob *j=(SubstJob*)arg;
+    char *buf=NULL; size_t cap=0;
+    size_t end=j->last<line_count?line_off(j->last):pt_length();
+    for(int ln=j->first;ln<j->last;) {
+        size_t a=line_off(ln);
+        int e=a+SEARCH_BLOCK<end?(int)pt_line_of(a+SEARCH_BLOCK):j->last;
+        if(e<=ln) e=ln+1;
+        size_t b=e<j->last?line_off(e):end;
+        if(b-a>cap) { cap=b-a; buf=(char*)realloc(buf,cap); }
+        pt_read(a,b-a,buf);
+        subst_scan(j,buf,b-a,a);
+        ln=e;
     }
-    return cx;
+    free(buf);
+}
+// 找出范围内所有匹配的起点（升序），返回个数，*lines 为含匹配的行数；大范围按处理器数分块并行
+size_t subst_find(const Subst *s, size_t **hits, int *lines) {
+    SearchPat sp; search_pat_init(&sp,s->pat);
+    sp.m=s->m;
+    search_kernel_init();
+    int rows=s->last-s->first, n=1;
+    if(rows>0&&(s->last<line_count?line_off(s->last):pt_length())-line_off(s->first)>=SEARCH_PAR_MIN) {
+        n=cpu_count();
+        if(n>SEARCH_MAX_THREADS) n=SEARCH_MAX_THREADS;
+        if(n>rows) n=rows;
+        if(n<1) n=1;
+    }
+    SubstJob jobs[SEARCH_MAX_THREADS]; thread_t th[SEARCH_MAX_THREADS]; int started[SEARCH_MAX_THREADS]={0};
+    for(int i=0;i<n;i++) {
+        jobs[i].s=s; jobs[i].sp=&sp; jobs[i].hits=NULL; jobs[i].count=jobs[i].cap=0; jobs[i].lines=0;
+        jobs[i].first=s->first+(int)((long long)rows*i/n); jobs[i].last=s->first+(int)((long long)rows*(i+1)/n);
+    }
+    for(int i=1;i<n;i++) {
+        started[i]=thread_start(&th[i],subst_worker,&jobs[i]);
+        if(!started[i]) subst_worker(&jobs[i]);
+    }
+    subst_worker(&jobs[0]);
+    size_t total=0;
+    *lines=0;
+    for(int i=0;i<n;i++) { if(started[i]) thread_join(th[i]); total+=jobs[i].count; *lines+=jobs[i].lines; }
+    *hits=(size_t*)malloc((total?total:1)*sizeof(size_t));
+    total=0;
+    for(int i=0;i<n;i++) {
+        if(jobs[i].count) memcpy(*hits+total,jobs[i].hits,jobs[i].count*sizeof(size_t));
+        total+=jobs[i].count; free(jobs[i].hits);
+    }
+    return total;
+}
+// 执行替换：相近的匹配合成一段整段替换，全部编辑记为一个撤销组；返回替换的处数，*lines 为涉及的行数
+size_t subst_run(const Subst *s, int *lines) {
+    size_t *hits, count=subst_find(s,&hits,lines), m=s->m, per=s->nrep-s->namp+s->namp*m, last=0;
+    long long delta=0;
+    if(count) undo_close();
+    for(size_t i=0;i<count;) {
+        size_t a=hits[i], b=a+m, k=i+1;
+        while(k<count&&hits[k]-b<SUBST_GAP) { b=hits[k]+m; k++; }
+        size_t len=b-a, outlen=len-(k-i)*m+(k-i)*per, w=0, at=0;
+        char *src=(char*)malloc(len), *out=(char*)malloc(outlen?outlen:1);
+        pt_read((size_t)(a+delta),len,src);
+        for(size_t h=i;h<k;h++) {
+            size_t rel=hits[h]-a;
+            memcpy(out+w,src+at,rel-at); w+=rel-at;
+            last=(size_t)(a+delta)+w;
+            for(size_t r=0;r<s->nrep;r++) {
+                if(s->rep[r]) out[w++]=s->rep[r];
+                else { memcpy(out+w,src+rel,m); w+=m; }
+            }
+            at=rel+m;
+        }
+        buf_delete((size_t)(a+delta),len); buf_insert((size_t)(a+delta),out,outlen);
+        delta+=(long long)outlen-(long long)len;
+        free(src); free(out);
+        i=k;
+    }
+    free(hits);
+    if(count) { cy=(int)pt_line_of(last); cx=0; undo_close(); }  // 光标停在最后一处替换所在的行
+    return count;
+}
+// 处理 :s 命令；cmd 不是替换命令时返回0
+int subst_command(const char *cmd) {
+    Subst s; const char *err; char msg[320];
+    if(!subst_parse(cmd,&s,&err)) return 0;
+    if(loader.active) { load_finish(); subst_parse(cmd,&s,&err); }  // 范围按完整文档的行号解析
+    if(view_mode) err="只读模式（-R）下不能替换";
+    if(!err) {
+        int lines; size_t n=subst_run(&s,&lines);
+        if(n) snprintf(msg,sizeof(msg),"已替换 %zu 处（%d 行），按任意键返回\n",n,lines);
+        else snprintf(msg,sizeof(msg),"未找到匹配内容！按任意键返回\n");
+    } else snprintf(msg,sizeof(msg),"%s，按任意键返回\n",err);
+    print_utf8(msg); term_getkey();
+    return 1;
 }
 
-// 模式切换
+// ------------- 编辑命令 -------------
+// 正常模式各按键命令与命令模式的分发
+
+// 模式切换（由输入循环在本批输入处理完后重绘）
 void set_mode(EditorMode m) {
+    if(view_mode&&m==MODE_INSERT) return;
+    if(m!=mode) undo_seal();
     mode=m; insert_mode=(m==MODE_INSERT);
-    HANDLE hOut=GetStdHandle(STD_INPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hOut,&csbi);
-    int win_cols=csbi.srWindow.Right-csbi.srWindow.Left+1;
-    adjust_scroll(count_lines(normal_help)+2); adjust_hscroll(win_cols); draw();
 }
 
 // 撤销命令
 void undo_handler(int key) { undo_restore(); set_mode(mode); }
+// 重做命令
+void redo_handler(int key) { redo_restore(); set_mode(mode); }
 
 // 保存命令
 void save_curfile_handler(int key) {
@@ -443,51 +3832,54 @@ void norm_insert(int key) { set_mode(MODE_INSERT); }
 // 行首插入
 void norm_insert_head(int key) { cx=0; set_mode(MODE_INSERT); }
 // 行尾插入
-void norm_insert_end(int key) { cx=str_vis_width(lines[cy]); set_mode(MODE_INSERT); }
+void norm_insert_end(int key) { cx=line_width(cy); set_mode(MODE_INSERT); }
 // 光标左
-void norm_left(int key) { if(cx>0) cx=move_cx_left(lines[cy],cx); }
+void norm_left(int key) { if(cx>0) cx=line_move_left(cy,cx); }
 // 光标右
-void norm_right(int key) { if(cx<str_vis_width(lines[cy])) cx=move_cx_right(lines[cy],cx); }
+void norm_right(int key) { if(cx<line_width(cy)) cx=line_move_right(cy,cx); }
 // 光标上
-void norm_up(int key) { if(cy>0) cy--; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
+void norm_up(int key) { if(cy>0) cy--; if(cx>line_width(cy)) cx=line_width(cy); }
 // 光标下
-void norm_down(int key) { if(cy<line_count-1) cy++; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
+void norm_down(int key) { if(cy<line_count-1) cy++; if(cx>line_width(cy)) cx=line_width(cy); }
 // 行首
 void norm_line_head(int key) { cx=0; }
 // 行尾
-void norm_line_end(int key) { cx=str_vis_width(lines[cy]); }
+void norm_line_end(int key) { cx=line_width(cy); }
 // 删除字符
-void norm_del_char(int key) { int vislen=str_vis_width(lines[cy]); if(cx<vislen) delvis(lines[cy],cx); }
+void norm_del_char(int key) { if(view_mode) return; int vislen=line_width(cy); if(cx<vislen) delvis(cy,cx); }
 void norm_cmdmode(int key);
 
 // 插入新行
 void norm_insert_newline(int key) {
-    if(line_count<MAX_LINES-1) {
-        for(int i=line_count;i>cy+1;i--) strcpy(lines[i],lines[i-1]);
-        strcpy(lines[cy+1],""); cy++; cx=0; line_count++; insert_mode=1;
-    }
+    if(view_mode) return;
+    int n=cmd_count?cmd_count:1;
+    char *nl=(char*)malloc(n); memset(nl,'\n',n);
+    buf_insert(line_off(cy)+line_len(cy),nl,n); free(nl);
+    cy++; cx=0; insert_mode=1;
 }
-// 删除当前行
+// 删除从当前行起的 cmd_count 行（默认1行），整段一次删除
 void norm_del_line(int key) {
-    if(line_count>1) {
-        for(int i=cy;i<line_count-1;i++) strcpy(lines[i],lines[i+1]);
-        line_count--; if(cy>=line_count) cy=line_count-1; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]);
-    } else {
-        strcpy(lines[0],""); cy=0; cx=0; line_count=1;
-    }
+    if(view_mode) return;
+    int n=cmd_count?cmd_count:1;
+    if(n>line_count-cy) n=line_count-cy;
+    if(cy+n<line_count) buf_delete(line_off(cy),line_off(cy+n)-line_off(cy));
+    else if(cy>0) { size_t s=line_off(cy)-1; buf_delete(s,pt_length()-s); }
+    else { buf_delete(0,pt_length()); cy=0; cx=0; }
+    if(cy>=line_count) cy=line_count-1;
+    if(cx>line_width(cy)) cx=line_width(cy);
 }
 // 查找下一个
 void norm_search_next(int key) {
     if(last_pat[0]) {
-        int found=search_pat(last_pat,cy+1);
-        if(found!=-1) { cy=found; last_found=found; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
+        int found=search_pat(last_pat,last_regex,cy+1);
+        if(found!=-1) { cy=found; last_found=found; if(cx>line_width(cy)) cx=line_width(cy); }
     }
 }
 // 查找上一个
 void norm_search_prev(int key) {
     if(last_pat[0]) {
-        int found=search_pat_rev(last_pat,cy-1);
-        if(found!=-1) { cy=found; last_found=found; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
+        int found=search_pat_rev(last_pat,last_regex,cy-1);
+        if(found!=-1) { cy=found; last_found=found; if(cx>line_width(cy)) cx=line_width(cy); }
     }
 }
 // 空操作
@@ -495,65 +3887,116 @@ void norm_noop(int key) {}
 // 组合键处理（gg, GG, oo, dd）
 void norm_combo_handler(int key) {
     static int gcount = 0, ocount = 0, dcount=0;
-    if(key == 'g') { gcount++; if(gcount==2) { cy=0; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); gcount=0; } return; }
-    if(key == 'G') { gcount++; if(gcount==2) { cy=line_count-1; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); gcount=0; } return; }
-    if(key == 'o') { ocount++; if(ocount==2) { norm_insert_newline(key); ocount=0; } return; }
-    if(key == 'd') { dcount++; if(dcount==2) { norm_del_line(key); dcount=0; } return; }
-    gcount=0; ocount=0; dcount=0;
+    if(key == 'g'||key == 'G') {
+        gcount++;
+        if(gcount==2) {
+            // 目标行尚未加载时等它加载到（GG 等到文件末尾）
+            if(cmd_count) load_wait_lines(cmd_count); else if(key=='G') load_finish();
+            cy=cmd_count?cmd_count-1:key=='g'?0:line_count-1;
+            if(cy>=line_count) cy=line_count-1;
+            if(cx>line_width(cy)) cx=line_width(cy);
+            gcount=0; cmd_count=0;
+        }
+        return;
+    }
+    if(key == 'o') { ocount++; if(ocount==2) { norm_insert_newline(key); ocount=0; cmd_count=0; } return; }
+    if(key == 'd') { dcount++; if(dcount==2) { norm_del_line(key); dcount=0; cmd_count=0; } return; }
+    gcount=0; ocount=0; dcount=0; cmd_count=0;
+}
+
+// 把码点序列编码为UTF-8命令串（截断到size）
+void cmd_encode(char *cmd, size_t size, const int *cps, int n) {
+    size_t len=0; char u[4];
+    for(int i=0;i<n;i++) {
+        int k=utf8_encode(cps[i],u);
+        if(len+k>=size) break;
+        memcpy(cmd+len,u,k); len+=k;
+    }
+    cmd[len]=0;
+}
+
+// 字节数格式化为 B/KB/MB/GB
+void fmt_size(char *out, size_t size, size_t n) {
+    const char *unit[]={"B","KB","MB","GB"}; double v=(double)n; int u=0;
+    while(v>=1024&&u<3) { v/=1024; u++; }
+    if(u) snprintf(out,size,"%.1f %s",v,unit[u]); else snprintf(out,size,"%u B",(unsigned)n);
+}
+// :mem 各子系统内存占用报告（已用 / 向系统申请）
+void mem_report(char *out, size_t size) {
+    char a[32], b[32], c[32], d[32];
+    size_t lc=0, dfa=0, total=0;
+    for(int i=0;i<LINE_CACHE;i++) lc+=line_cache[i].cap+line_cache[i].ck_cap*sizeof(ColCkpt);
+    dfa=match_dfa.cap*sizeof(DfaState)+match_dfa.htcap*sizeof(int)+(size_t)match_re.count*(2*sizeof(int)+sizeof(unsigned));
+    for(int i=0;i<match_dfa.count;i++) dfa+=match_dfa.st[i].nset*sizeof(int);
+    size_t nl=(orig_buf.nl_cap+add_buf.nl_cap)*sizeof(size_t), text=orig_buf.cap+add_buf.cap+nl+piece_pool.reserved+lc;
+    size_t search=match_cap*sizeof(int)+match_re.cap*sizeof(ReNode)+dfa;
+    size_t screen=sizeof(screenbuf)+sizeof(prevbuf)+out_cap+paste_cap+hl_cap+hl_attr_cap;
+    total=text+undo_pool.reserved+search+screen;
+    int n=0;
+    n+=snprintf(out+n,size-n,"内存占用（已用 / 已申请）：\n");
+    fmt_size(a,sizeof(a),orig_buf.len); fmt_size(b,sizeof(b),add_buf.len); fmt_size(c,sizeof(c),add_buf.cap); fmt_size(d,sizeof(d),nl);
+    n+=snprintf(out+n,size-n,"文本  原始缓冲 %s%s  添加缓冲 %s / %s  换行索引 %s%s\n",a,orig_buf.mapped?"（文件映射）":"",b,c,d,orig_buf.nl_step?"（稀疏）":"");
+    fmt_size(a,sizeof(a),piece_pool.used); fmt_size(b,sizeof(b),piece_pool.reserved); fmt_size(c,sizeof(c),lc);
+    n+=snprintf(out+n,size-n,"      片段 %s / %s  行缓存 %s\n",a,b,c);
+    fmt_size(a,sizeof(a),undo_pool.used); fmt_size(b,sizeof(b),undo_pool.reserved); fmt_size(c,sizeof(c),undo_bytes);
+    n+=snprintf(out+n,size-n,"撤销  记录 %s / %s（日志 %s，上限 %d MB）\n",a,b,c,UNDO_MEM_LIMIT>>20);
+    fmt_size(a,sizeof(a),match_count*sizeof(int)); fmt_size(b,sizeof(b),match_cap*sizeof(int)); fmt_size(c,sizeof(c),match_re.cap*sizeof(ReNode)+dfa);
+    n+=snprintf(out+n,size-n,"搜索  匹配索引 %s / %s  正则 %s\n",a,b,c);
+    fmt_size(a,sizeof(a),sizeof(screenbuf)+sizeof(prevbuf)); fmt_size(b,sizeof(b),out_cap); fmt_size(c,sizeof(c),paste_cap);
+    n+=snprintf(out+n,size-n,"屏幕  单元格 %s  输出缓冲 %s  粘贴缓冲 %s\n",a,b,c);
+    fmt_size(a,sizeof(a),hl_cap+hl_attr_cap);
+    n+=snprintf(out+n,size-n,"高亮  %s  行末状态 %s  已缓存 %d 行，累计扫描 %zu 行\n",syntax?syntax->name:"关闭",a,hl_known,hl_lexed);
+    fmt_size(a,sizeof(a),total);
+    snprintf(out+n,size-n,"合计  %s\n",a);
 }
 
 // 命令模式入口
 void norm_cmdmode(int key) {
-    set_console_normal();
-    HANDLE hOut=GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hOut,&csbi);
-    int win_cols=csbi.srWindow.Right-csbi.srWindow.Left+1, win_rows=csbi.srWindow.Bottom-csbi.srWindow.Top+1;
+    int win_rows, win_cols;
+    get_win_size(&win_rows,&win_cols);
     int normal_help_lines=count_lines(normal_help)+2, command_help_lines=count_lines(cmd_help)+2;
     int max_help_lines=normal_help_lines>command_help_lines?normal_help_lines:command_help_lines;
     int start_line=win_rows-max_help_lines, line=win_rows-command_help_lines;
-    for(int i=start_line;i<win_rows;i++) { memset(screenbuf[i],' ',win_cols-1); screenbuf[i][win_cols-1]=0; }
-    snprintf(screenbuf[line],win_cols,"%-*s",win_cols-1,"命令模式"); line++;
-    const char *p=cmd_help;
-    while(*p) { int len=0; while(p[len]&&p[len]!='\n') len++;
-        snprintf(screenbuf[line],win_cols,"%.*s%*s",len,p,win_cols-1-len,""); line++;
-        if(p[len]=='\n') p+=len+1; else break;
-    }
-    snprintf(screenbuf[win_rows-1],win_cols,":%-*s",win_cols-2,"");
+    for(int i=start_line;i<win_rows;i++) screen_row_text(i,win_cols,"");
+    screen_row_text(line++,win_cols,"命令模式");
+    screen_lines(line,win_cols,cmd_help);
+    screen_row_text(win_rows-1,win_cols,":");
+    screen_cursor(1,win_rows-1);
     flush_screen_buf(win_rows,win_cols);
 
     char cmd[256]="";
-    wchar_t wbuf[MAX_COLS]={0}; int wlen=0;
+    int wbuf[MAX_COLS]={0}; int wlen=0;
     int hist_pos = cmd_history_count;
     while(1) {
-        int ch=_getwch();
+        int ch=term_getkey();
         if(ch==13||ch==10) break;
         else if(ch==8||ch==127) { if(wlen>0) wlen--; }
-        else if(ch==27) { set_console_raw(); draw(); return; }
-        else if(ch==0||ch==224) {
-            int arrow=_getwch();
-            if(arrow==72) {
+        else if(ch==27) { draw(); return; }
+        else if(ch==KEY_UP||ch==KEY_DOWN) {
+            if(ch==KEY_UP) {
                 if(hist_pos > 0) hist_pos--;
-                if(hist_pos < cmd_history_count) {
-                    wlen = MultiByteToWideChar(CP_UTF8,0,cmd_history[hist_pos],-1,wbuf,MAX_COLS-1); if(wlen>0) wlen--;
-                }
-            } else if(arrow==80) {
+            } else {
                 if(hist_pos < cmd_history_count-1) hist_pos++;
                 else hist_pos = cmd_history_count;
-                if(hist_pos < cmd_history_count) {
-                    wlen = MultiByteToWideChar(CP_UTF8,0,cmd_history[hist_pos],-1,wbuf,MAX_COLS-1); if(wlen>0) wlen--;
-                } else wlen=0;
             }
-        } else if(wlen<MAX_COLS-1) wbuf[wlen++]=ch;
-        int utf8len=WideCharToMultiByte(CP_UTF8,0,wbuf,wlen,cmd,sizeof(cmd)-1,NULL,NULL);
-        cmd[utf8len]=0;
-        snprintf(screenbuf[win_rows-1],win_cols,":%-*s",win_cols-2,cmd);
+            if(hist_pos < cmd_history_count) {
+                const char *h=cmd_history[hist_pos];
+                for(wlen=0;*h&&wlen<MAX_COLS-1;wlen++) h+=utf8_decode(h,&wbuf[wlen]);
+            } else if(ch==KEY_DOWN) wlen=0;
+        } else if(ch==KEY_PASTE) {
+            for(size_t i=0;i<paste_len&&wlen<MAX_COLS-1;) {
+                int cp; i+=utf8_decode_n(paste_buf+i,paste_len-i,&cp);
+                if(cp=='\r'||cp=='\n') break;
+                wbuf[wlen++]=cp;
+            }
+        } else if(ch<KEY_UP&&wlen<MAX_COLS-1) wbuf[wlen++]=ch;
+        cmd_encode(cmd,sizeof(cmd),wbuf,wlen);
+        char line_buf[260]; snprintf(line_buf,sizeof(line_buf),":%s",cmd);
+        screen_row_text(win_rows-1,win_cols,line_buf);
+        screen_cursor(1+str_vis_width(cmd),win_rows-1);
         flush_screen_buf(win_rows,win_cols);
-        COORD pos; pos.X=1+str_vis_width(cmd); pos.Y=win_rows-1;
-        SetConsoleCursorPosition(hOut,pos);
     }
-    int utflen=WideCharToMultiByte(CP_UTF8,0,wbuf,wlen,cmd,sizeof(cmd)-1,NULL,NULL);
-    cmd[utflen]=0;
+    cmd_encode(cmd,sizeof(cmd),wbuf,wlen);
     trim(cmd);
     if(cmd[0]) {
         if(cmd_history_count==0 || strcmp(cmd, cmd_history[cmd_history_count-1])!=0) {
@@ -564,50 +4007,124 @@ void norm_cmdmode(int key) {
             }
         }
     }
-    set_console_raw();
     // :go 跳转
     if(strncmp(cmd,"go ",3)==0) {
         int lineno = atoi(cmd+3);
+        load_wait_lines(lineno);
         if(lineno >= 1 && lineno <= line_count) {
             cy = lineno - 1;
-            if(cx > str_vis_width(lines[cy])) cx = str_vis_width(lines[cy]);
+            if(cx > line_width(cy)) cx = line_width(cy);
         } else {
             print_utf8("行号超出范围，按任意键返回\n");
-            _getch();
+            term_getkey();
         }
     }
     // 其它命令处理
-    else if(strncmp(cmd,"f ",2)==0) {
-        char *pattern=(char*)(cmd+2); trim(pattern);
-        strncpy(last_pat,pattern,127); last_pat[127]=0;
-        int found=search_pat(last_pat,cy+1);
-        if(found!=-1) { cy=found; last_found=found; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
-        else { print_utf8("未找到匹配内容！\n"); _getch(); last_pat[0]=0; }
-    } else if(strncmp(cmd,"wq",2)==0) {
+    else if(strncmp(cmd,"f ",2)==0||strncmp(cmd,"fr ",3)==0) {
+        int regex=cmd[1]=='r';
+        char *pattern=(char*)(cmd+(regex?3:2)); trim(pattern);
+        const char *err;
+        if(!match_index_build(pattern,regex,&err)) {
+            char msg[256]; snprintf(msg,sizeof(msg),"正则表达式有误：%s 按任意键返回\n",err);
+            print_utf8(msg); term_getkey(); draw(); return;
+        }
+        strncpy(last_pat,pattern,127); last_pat[127]=0; last_regex=regex;
+        int found=search_pat(last_pat,last_regex,cy+1);
+        if(found!=-1) { cy=found; last_found=found; if(cx>line_width(cy)) cx=line_width(cy); }
+        else { print_utf8("未找到匹配内容！\n"); term_getkey(); last_pat[0]=0; }
+    } else if(view_mode&&cmd[0]=='w') { print_utf8("只读模式（-R）下不能保存，按任意键返回\n"); term_getkey(); }
+    else if(strncmp(cmd,"wq",2)==0) {
         if(cmd[2]==' '&&cmd[3]) { file_save(cmd+3); exit(0); }
-        else { if(filename[0]=='\0') { char input[16]={0}; set_console_normal(); print_utf8("当前未打开文件，默认文件名为test.txt\n:w test.txt    可另存为test.txt文件\n是否确认继续保存为test.txt？(y/n)\n请输入y或n后回车: "); fgets(input,sizeof(input),stdin); set_console_raw(); int i=0; while(input[i]==' '||input[i]=='\t') i++; if(input[i]=='y'||input[i]=='Y') { file_save("test.txt"); exit(0); } else { print_utf8("已取消保存。按任意键返回\n"); _getch(); draw(); return; }} else { file_save(filename); exit(0); } }
+        else { if(filename[0]=='\0') { char input[16]={0}; set_console_normal(); print_utf8("当前未打开文件，默认文件名为test.txt\n:w test.txt    可另存为test.txt文件\n是否确认继续保存为test.txt？(y/n)\n请输入y或n后回车: "); fgets(input,sizeof(input),stdin); set_console_raw(); int i=0; while(input[i]==' '||input[i]=='\t') i++; if(input[i]=='y'||input[i]=='Y') { file_save("test.txt"); exit(0); } else { print_utf8("已取消保存。按任意键返回\n"); term_getkey(); draw(); return; }} else { file_save(filename); exit(0); } }
     } else if(strncmp(cmd,"w ",2)==0) file_save(cmd+2);
-    else if(strcmp(cmd,"w")==0) { if(filename[0]=='\0') { char input[16]={0}; set_console_normal(); print_utf8("当前未打开文件，默认文件名为test.txt\n:w test.txt    可另存为test.txt文件\n是否确认继续保存为test.txt？(y/n)\n请输入y或n后回车: "); fgets(input,sizeof(input),stdin); set_console_raw(); int i=0; while(input[i]==' '||input[i]=='\t') i++; if(input[i]=='y'||input[i]=='Y') file_save("test.txt"); else { print_utf8("已取消保存。按任意键返回\n"); _getch(); } } else file_save(filename); }
+    else if(strcmp(cmd,"w")==0) { if(filename[0]=='\0') { char input[16]={0}; set_console_normal(); print_utf8("当前未打开文件，默认文件名为test.txt\n:w test.txt    可另存为test.txt文件\n是否确认继续保存为test.txt？(y/n)\n请输入y或n后回车: "); fgets(input,sizeof(input),stdin); set_console_raw(); int i=0; while(input[i]==' '||input[i]=='\t') i++; if(input[i]=='y'||input[i]=='Y') file_save("test.txt"); else { print_utf8("已取消保存。按任意键返回\n"); term_getkey(); } } else file_save(filename); }
     else if(strcmp(cmd,"q")==0||strcmp(cmd,"q!")==0) exit(0);
     else if(strncmp(cmd,"r ",2)==0) file_load(cmd+2);
-    else if(strcmp(cmd,"set nu")==0) { show_lineno=1; print_utf8("已开启显示行号，按任意键返回\n"); _getch(); }
-    else if(strcmp(cmd,"set nonu")==0) { show_lineno=0; print_utf8("已关闭显示行号，按任意键返回\n"); _getch(); }
-    else if(cmd[0]=='!') { system(cmd+1); print_utf8("外部命令已执行，按任意键返回\n"); _getch(); }
-    else if(cmd[0]) { char msg[128]; snprintf(msg,sizeof(msg),"未识别命令: %s 按任意键返回\n",cmd); print_utf8(msg); _getch(); }
+    else if(strcmp(cmd,"set nu")==0) { show_lineno=1; print_utf8("已开启显示行号，按任意键返回\n"); term_getkey(); }
+    else if(strcmp(cmd,"set nonu")==0) { show_lineno=0; print_utf8("已关闭显示行号，按任意键返回\n"); term_getkey(); }
+    else if(strncmp(cmd,"set autosave=",13)==0) {
+        char msg[128]; autosave_sec=atoi(cmd+13); if(autosave_sec<0) autosave_sec=0;
+        autosave_last=now_ns(); autosave_status[0]=0;
+        if(autosave_sec) snprintf(msg,sizeof(msg),"已开启自动保存，每 %d 秒，按任意键返回\n",autosave_sec);
+        else snprintf(msg,sizeof(msg),"已关闭自动保存，按任意键返回\n");
+        print_utf8(msg); term_getkey();
+    }
+    else if(strncmp(cmd,"set enc=",8)==0||strncmp(cmd,"set ff=",7)==0) {
+        char msg[128]; const char *v=strchr(cmd,'=')+1; int ok=1;
+        if(cmd[4]=='f') { if(!strcmp(v,"unix")) doc_crlf=0; else if(!strcmp(v,"dos")) doc_crlf=1; else ok=0; }
+        else { int bom, e=enc_parse(v,&bom); if(e<0) ok=0; else { doc_enc=e; doc_bom=bom; } }  // UTF-16 总是带 BOM 写出
+        if(ok) snprintf(msg,sizeof(msg),"保存时使用 %s%s 编码、%s 换行，按任意键返回\n",enc_names[doc_enc],doc_bom&&doc_enc==ENC_UTF8?"(BOM)":"",doc_crlf?"CRLF":"LF");
+        else snprintf(msg,sizeof(msg),"不支持的设置: %s 按任意键返回\n",v);
+        print_utf8(msg); term_getkey();
+    }
+    else if(strncmp(cmd,"set syntax=",11)==0) {
+        char msg[320]; const Syntax *sx=syntax_find(cmd+11);
+        if(sx||!strcmp(cmd+11,"off")) { syntax_set(sx); snprintf(msg,sizeof(msg),sx?"语法高亮：%s，按任意键返回\n":"已关闭语法高亮，按任意键返回\n",sx?sx->name:""); }
+        else snprintf(msg,sizeof(msg),"不支持的语法: %s 按任意键返回\n",cmd+11);
+        print_utf8(msg); term_getkey();
+    }
+    else if(strcmp(cmd,"follow")==0) {
+        const char *err=follow_start(); char msg[512];
+        if(err) snprintf(msg,sizeof(msg),"%s，按任意键返回\n",err);
+        else snprintf(msg,sizeof(msg),"开始跟随 %s 的新增内容（%s），:nofollow 停止，按任意键返回\n",filename,follow.wd>=0?"文件变化通知":"定时检查");
+        print_utf8(msg); term_getkey();
+    }
+    else if(strcmp(cmd,"nofollow")==0) { follow_stop(NULL); print_utf8("已停止跟随，按任意键返回\n"); term_getkey(); }
+    else if(strcmp(cmd,"mem")==0) { char msg[1024]; mem_report(msg,sizeof(msg)); print_utf8(msg); print_utf8("按任意键返回\n"); term_getkey(); }
+    else if(strcmp(cmd,"perf")==0) { char msg[1024]; perf_report(msg,sizeof(msg)); print_utf8(msg); print_utf8("按任意键返回\n"); term_getkey(); }
+    else if(strcmp(cmd,"perf reset")==0) perf_reset();
+    else if(subst_command(cmd)) {}
+    else if(cmd[0]=='!') { set_console_normal(); system(cmd+1); set_console_raw(); print_utf8("外部命令已执行，按任意键返回\n"); term_getkey(); }
+    else if(cmd[0]) { char msg[128]; snprintf(msg,sizeof(msg),"未识别命令: %s 按任意键返回\n",cmd); print_utf8(msg); term_getkey(); }
     draw();
 }
 
 // 正常模式命令分发
 void norm_dispatch(int key) {
+    // 数字前缀：1-8 开头，之后 0-9 都计入（0/9 单独按下仍是行首/行尾）
+    if((key>='1'&&key<='8')||(cmd_count&&key>='0'&&key<='9')) {
+        if(cmd_count<CMD_COUNT_MAX/10) cmd_count=cmd_count*10+key-'0';
+        return;
+    }
     for(int i=0;i<NORM_CMD_NUM;i++) {
         if(normal_cmds[i].key==key) {
             normal_cmds[i].handler(key);
+            if(normal_cmds[i].handler!=norm_combo_handler) cmd_count=0;
             return;
         }
     }
     norm_combo_handler(key);
 }
 
+// 在光标处一次插入一段文本（粘贴）：换行统一为\n，整段作为一次编辑，不逐键处理；光标移到其后
+void insert_text(char *s, size_t n) {
+    size_t w=0, last=0;
+    int nl=0;
+    for(size_t i=0;i<n;i++) {
+        char c=s[i];
+        if(c=='\r') { c='\n'; if(i+1<n&&s[i+1]=='\n') i++; }
+        if(c=='\n') { nl++; last=w+1; }
+        s[w++]=c;
+    }
+    if(!w) return;
+    int pos=line_vis2real(cy,cx);
+    buf_insert(line_off(cy)+pos,s,w);
+    if(nl) { cy+=nl; cx=line_real2vis(cy,(int)(w-last)); }
+    else cx=line_real2vis(cy,pos+(int)w);
+}
+void dispatch_key(int key);
+// 正常模式下粘贴的内容逐个按键处理，中途进入插入模式后其余部分整段插入
+void replay_paste() {
+    size_t n=paste_len;
+    char *s=(char*)malloc(n+1); memcpy(s,paste_buf,n); s[n]=0;
+    for(size_t i=0;i<n;) {
+        if(insert_mode) { insert_text(s+i,n-i); break; }
+        int cp; i+=utf8_decode_n(s+i,n-i,&cp);
+        dispatch_key(cp=='\n'?13:cp);
+    }
+    free(s);
+}
+
 // 插入模式命令分发
 /**
  * 
@@ -616,13 +4133,13 @@ void norm_dispatch(int key) {
  * - Esc（27）：切换到普通模式。
  * - 回车（13 或 10）：在当前行下方插入新行，并将光标移动到新行起始。
  * - 退格（8 或 127）：删除光标前的字符，或在行首时合并上一行。
- * - 方向键（0 或 224 后跟箭头码）：移动光标位置（左右移动字符，或上下移动行）。
- * - 其他字符：将输入的字符（支持 UTF-8 和代理对）插入到当前光标位置。
+ * - 方向键（终端后端转换为 KEY_*）：移动光标位置（左右移动字符，或上下移动行）。
+ * - 粘贴（KEY_PASTE）：粘贴缓冲中的整段文本一次插入，只拆分一次行。
+ * - 其他字符：将输入的码点编码为 UTF-8 插入到当前光标位置。
  *
  * 主要流程：
- * 1. 获取控制台窗口信息，计算窗口宽度。
- * 2. 根据不同按键类型，调用相应的编辑操作函数（如 undo_save、insvis、delvis 等）。
- * 3. 维护行内容（lines）、光标位置（cx, cy）、行数（line_count）等全局变量。
+ * 1. 根据不同按键类型，调用相应的编辑操作函数（如 insvis、delvis 等，编辑自动记入撤销日志）。
+ * 2. 通过片表缓冲（buf_insert/buf_delete）修改文本，并维护光标位置（cx, cy）、行数（line_count）等全局变量。
  *
  *
  * 
@@ -631,79 +4148,365 @@ void norm_dispatch(int key) {
  * @param key 用户按下的键值（支持 ASCII、控制键和 Unicode 字符）。
  */
 void insert_dispatch(int key) {
-    HANDLE hOut=GetStdHandle(STD_INPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    GetConsoleScreenBufferInfo(hOut,&csbi);
-    int win_cols=csbi.srWindow.Right-csbi.srWindow.Left+1;
     if(key==27) { set_mode(MODE_NORMAL); return; }
+    else if(key==KEY_PASTE) insert_text(paste_buf,paste_len);
     else if(key==13||key==10) {
-        if(line_count<MAX_LINES-1) {
-            undo_save();
-            for(int i=line_count;i>cy+1;i--) strcpy(lines[i],lines[i-1]);
-            int realpos=vis2real(lines[cy],cx);
-            strcpy(lines[cy+1],lines[cy]+realpos);
-            lines[cy][realpos]=0; cy++; cx=0; line_count++;
-        }
+        buf_insert(line_off(cy)+line_vis2real(cy,cx),"\n",1); cy++; cx=0;
     } else if(key==8||key==127) {
-        if(cx>0) { undo_save(); delvis(lines[cy],cx-1); cx--; }
+        if(cx>0) { int prev=line_move_left(cy,cx); delvis(cy,prev); cx=prev; }
         else if(cy>0) {
-            undo_save();
-            int prevlen=strlen(lines[cy-1]);
-            if(prevlen+strlen(lines[cy])<MAX_COLS-1) {
-                strcat(lines[cy-1],lines[cy]);
-                for(int i=cy;i<line_count-1;i++) strcpy(lines[i],lines[i+1]);
-                line_count--; cy--; cx=str_vis_width(lines[cy]);
-            }
+            int prevw=line_width(cy-1);
+            buf_delete(line_off(cy)-1,1); cy--; cx=prevw;
         }
-    } else if(key==0||key==224) {
-        int arrow=_getwch();
-        if(arrow==75&&cx>0) cx=move_cx_left(lines[cy],cx);
-        else if(arrow==77&&cx<str_vis_width(lines[cy])) cx=move_cx_right(lines[cy],cx);
-        else if(arrow==72&&cy>0) { cy--; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
-        else if(arrow==80&&cy<line_count-1) { cy++; if(cx>str_vis_width(lines[cy])) cx=str_vis_width(lines[cy]); }
+    } else if(key>=KEY_UP) {
+        undo_seal();
+        if(key==KEY_LEFT&&cx>0) cx=line_move_left(cy,cx);
+        else if(key==KEY_RIGHT&&cx<line_width(cy)) cx=line_move_right(cy,cx);
+        else if(key==KEY_UP&&cy>0) { cy--; if(cx>line_width(cy)) cx=line_width(cy); }
+        else if(key==KEY_DOWN&&cy<line_count-1) { cy++; if(cx>line_width(cy)) cx=line_width(cy); }
     } else {
-        //转换为宽字符
-        wchar_t wch=key;
-        if(wch>=0xD800&&wch<=0xDBFF) {
-            //高代理，三位一个
-            wchar_t wch2=_getwch(); wchar_t wstr[3]={wch,wch2,0}; char utf8[8]={0};
-            int utflen=WideCharToMultiByte(CP_UTF8,0,wstr,2,utf8,sizeof(utf8)-1,NULL,NULL);
-            if(utflen>0&&strlen(lines[cy])+utflen<MAX_COLS-1) { undo_save(); insvis(lines[cy],cx,utf8,utflen); cx+=char_width(utf8,0); }
-        } else {
-            //非高代理，直接转换UTF8流，并使用insvis插入
-            wchar_t wstr[2]={wch,0}; char utf8[8]={0};
-            int utflen=WideCharToMultiByte(CP_UTF8,0,wstr,1,utf8,sizeof(utf8)-1,NULL,NULL);
-            if(utflen>0&&strlen(lines[cy])+utflen<MAX_COLS-1) { undo_save(); insvis(lines[cy],cx,utf8,utflen); cx+=char_width(utf8,0); }
+        //码点编码为UTF-8，并使用insvis插入
+        char utf8[8]={0};
+        int utflen=utf8_encode(key,utf8);
+        cx=insvis(cy,cx,utf8,utflen);
+    }
+}
+
+// 处理一个按键（不重绘）
+void dispatch_key(int key) {
+    if(insert_mode) { insert_dispatch(key); return; }
+    if(key==KEY_PASTE) replay_paste();
+    else if(key>=KEY_UP) {
+        if(key==KEY_LEFT) norm_left(key);
+        else if(key==KEY_RIGHT) norm_right(key);
+        else if(key==KEY_UP) norm_up(key);
+        else if(key==KEY_DOWN) norm_down(key);
+    } else {
+        norm_dispatch(key);
+    }
+}
+// 处理一个按键及其后已经到达的全部输入：整批编辑合为一个撤销组，处理完只重绘一次；
+// 一批处理超过 INPUT_BATCH_NS 时先重绘，下一批继续
+void process_input(int key) {
+    unsigned long long t0=now_ns(), t;
+    unsigned reads=perf_reads;
+    load_poll();
+    if(!insert_mode) undo_seal();
+    undo_hold=1;
+    t=now_ns(); dispatch_key(key);
+    while(1) {
+        // 处理中等待过输入（命令行、提示）的不计时
+        t=perf_reads==reads?perf_mark(PERF_DISPATCH,t):now_ns();
+        if(t-t0>=INPUT_BATCH_NS||!term.key_pending(0)) break;
+        key=term_getkey(); reads=perf_reads;
+        t=perf_mark(PERF_READ,t);
+        dispatch_key(key);
+    }
+    undo_release();
+    swap_flush(0); save_finish(0); autosave_tick(); follow_poll();
+    mem_compact();
+    adjust_hscroll(MAX_COLS_SCREEN);
+    adjust_scroll(count_lines(insert_mode?insert_help:normal_help)+2); draw();
+    if(perf_reads==reads) perf_add(PERF_KEY,now_ns()-t0);
+}
+
+#ifdef ONEDITOR_BENCH
+// ------------- 基准测试 -------------
+// 构建：gcc -O2 -pthread -DONEDITOR_BENCH oneditor.c -o oneditor_bench
+// 用按键脚本驱动真实的 norm_dispatch/insert_dispatch/norm_cmdmode 路径，输出到内存中的无头屏幕；
+// 每个按键的延迟 = 从交付该键到编辑器请求下一个键的时间（含重绘）。
+#include <setjmp.h>
+
+#define BENCH_ROWS 40                 // 无头屏幕行数
+#define BENCH_COLS 120                // 无头屏幕列数
+
+const char *bench_keys;               // 当前脚本
+size_t bench_len, bench_pos;
+int bench_unget = -1;
+unsigned long long bench_last;        // 上一个按键交付的时刻
+unsigned long long *bench_samples;    // 每键延迟（纳秒）
+size_t bench_nsamples, bench_cap;
+size_t bench_out_bytes;               // 输出到终端的字节数
+int bench_paste = 0;                  // 脚本是否整段已到达（粘贴），否则按逐键输入处理
+jmp_buf bench_end;                    // 脚本结束时跳回驱动
+
+int bench_getbyte(int timeout_ms) {
+    if(bench_unget>=0) { int c=bench_unget; bench_unget=-1; return c; }
+    if(bench_pos>=bench_len) return -1;
+    return (unsigned char)bench_keys[bench_pos++];
+}
+void bench_ungetbyte(int c) { bench_unget=c; }
+// 无头后端读键：记录上一个键的延迟，脚本结束时跳回驱动
+int headless_read_key() {
+    unsigned long long t=now_ns();
+    if(bench_last) {
+        if(bench_nsamples==bench_cap) { bench_cap=bench_cap?bench_cap*2:4096; bench_samples=(unsigned long long*)realloc(bench_samples,bench_cap*sizeof(unsigned long long)); }
+        bench_samples[bench_nsamples++]=t-bench_last;
+    }
+    int k=parse_key(bench_getbyte,bench_ungetbyte);
+    if(k<0) longjmp(bench_end,1);
+    bench_last=now_ns();
+    return k;
+}
+// 粘贴场景下脚本剩余部分都视为已到达的输入
+int headless_key_pending(int ms) { return bench_paste&&(bench_unget>=0||bench_pos<bench_len); }
+void headless_init() {}
+void headless_shutdown() {}
+void headless_set_raw(int raw) {}
+void headless_get_size(int *rows, int *cols) { *rows=BENCH_ROWS; *cols=BENCH_COLS; }
+// 本帧输出只计字节数，不写终端
+void headless_end_frame(int x, int y, int dirty) {
+    char esc[32];
+    out_append(esc,snprintf(esc,sizeof(esc),"\x1b[%d;%dH",y+1,x+1));
+    bench_out_bytes+=out_len-(dirty?0:out_pre);
+}
+void headless_print(const char *s) { bench_out_bytes+=strlen(s); }
+TermBackend headless_term={"headless",headless_init,headless_shutdown,headless_set_raw,headless_read_key,headless_key_pending,headless_get_size,
+    ansi_begin_frame,ansi_put_span,headless_end_frame,headless_print};
+
+// 按键脚本构建缓冲
+typedef struct { char *p; size_t len, cap; } BenchBuf;
+void bb_add(BenchBuf *b, const char *s, size_t n) {
+    if(b->len+n>b->cap) { while(b->len+n>b->cap) b->cap=b->cap?b->cap*2:65536; b->p=(char*)realloc(b->p,b->cap); }
+    memcpy(b->p+b->len,s,n); b->len+=n;
+}
+void bb_str(BenchBuf *b, const char *s) { bb_add(b,s,strlen(s)); }
+
+int cmp_u64(const void *a, const void *b) {
+    unsigned long long x=*(const unsigned long long*)a, y=*(const unsigned long long*)b;
+    return x<y?-1:x>y;
+}
+// 在给定文档上回放按键脚本并报告延迟分布与吞吐
+void bench_run(const char *name, char *doc, size_t doc_len, const char *keys, size_t nkeys) {
+    doc_replace(doc,doc_len,0);
+    mode=MODE_NORMAL; insert_mode=0; last_pat[0]=0; screen_valid=0;
+    bench_keys=keys; bench_len=nkeys; bench_pos=0; bench_unget=-1;
+    bench_last=0; bench_nsamples=0; bench_out_bytes=0;
+    adjust_scroll(count_lines(normal_help)+2); draw();
+    unsigned long long t0=now_ns();
+    if(!setjmp(bench_end)) while(1) process_input(term_getkey());
+    undo_release();                   // 脚本可能在一批输入中途结束
+    unsigned long long total=now_ns()-t0;
+    if(!bench_nsamples) { printf("%-10s 无按键\n",name); return; }
+    qsort(bench_samples,bench_nsamples,sizeof(unsigned long long),cmp_u64);
+    unsigned long long p50=bench_samples[bench_nsamples*50/100], p99=bench_samples[bench_nsamples*99/100], mx=bench_samples[bench_nsamples-1];
+    printf("%-10s 按键 %8zu  总计 %9.1f ms  吞吐 %10.0f 键/秒  p50 %8.1f us  p99 %8.1f us  max %9.1f us  输出 %zu 字节\n",
+        name,bench_nsamples,total/1e6,bench_nsamples/(total/1e9),p50/1e3,p99/1e3,mx/1e3,bench_out_bytes);
+}
+// 生成 n 行文本，每隔 every 行（every>0）插入一次 needle
+char *bench_doc(size_t n, const char *needle, size_t every, size_t *len) {
+    BenchBuf b={0};
+    char line[128];
+    for(size_t i=0;i<n;i++) {
+        int k=snprintf(line,sizeof(line),"%zu the quick brown fox jumps over the lazy dog %s\n",i,(every&&i%every==every-1)?needle:"");
+        bb_add(&b,line,k);
+    }
+    *len=b.len;
+    return b.p;
+}
+// 读取整个文件到内存
+char *bench_read_file(const char *fname, size_t *len) {
+    FILE *fp=fopen_utf8(fname,"rb");
+    if(!fp) return NULL;
+    BenchBuf b={0}; char tmp[65536]; size_t n;
+    while((n=fread(tmp,1,sizeof(tmp),fp))>0) bb_add(&b,tmp,n);
+    fclose(fp);
+    if(!b.p) b.p=(char*)malloc(1);
+    *len=b.len;
+    return b.p;
+}
+
+// 基准入口：无参数时运行内置场景；oneditor_bench 脚本文件 [文本文件] 回放录制的按键
+int bench_main(int argc, char *argv[]) {
+    term=headless_term;
+    size_t len;
+    if(argc>1) {
+        size_t nkeys; char *keys=bench_read_file(argv[1],&nkeys);
+        if(!keys) { fprintf(stderr,"无法读取脚本: %s\n",argv[1]); return 1; }
+        char *doc=argc>2?bench_read_file(argv[2],&len):(char*)calloc(1,1);
+        if(!doc) { fprintf(stderr,"无法读取文件: %s\n",argv[2]); return 1; }
+        if(argc<=2) len=0;
+        bench_run("script",doc,len,keys,nkeys);
+        return 0;
+    }
+    BenchBuf k={0};
+    char *doc;
+    // 连续输入 10 万字符，每 80 个字符换行
+    bb_str(&k,"i");
+    for(int i=0;i<100000;i++) bb_add(&k,i%80==79?"\r":&"abcdefghijklmnopqrstuvwxyz"[i%26],1);
+    bb_str(&k,"\x1b");
+    bench_run("type",(char*)calloc(1,1),0,k.p,k.len);
+    // 同样的内容一次粘贴进来
+    bench_paste=1;
+    bench_run("paste",(char*)calloc(1,1),0,k.p,k.len);
+    bench_paste=0;
+    // 括号粘贴 10 MB 文本
+    k.len=0;
+    bb_str(&k,"i\x1b[200~");
+    doc=bench_doc(160000,"",0,&len);
+    bb_add(&k,doc,len); free(doc);
+    bb_str(&k,"\x1b[201~\x1b");
+    bench_run("bracketed",(char*)calloc(1,1),0,k.p,k.len);
+    // 1 万次 dd
+    k.len=0;
+    for(int i=0;i<10000;i++) bb_str(&k,"dd");
+    doc=bench_doc(20000,"",0,&len);
+    bench_run("dd",doc,len,k.p,k.len);
+    // 20 次 1000dd
+    k.len=0;
+    for(int i=0;i<20;i++) bb_str(&k,"1000dd");
+    doc=bench_doc(20000,"",0,&len);
+    bench_run("1000dd",doc,len,k.p,k.len);
+    // 100 万行文件中搜索，随后 n 跳转 20 次
+    k.len=0;
+    bb_str(&k,":f needle\r");
+    for(int i=0;i<20;i++) bb_str(&k,"n");
+    doc=bench_doc(1000000,"needle",100000,&len);
+    bench_run("search",doc,len,k.p,k.len);
+    // 同一文件上用没有字面前缀的正则搜索（整个缓冲走DFA），随后 n 跳转 20 次
+    k.len=0;
+    bb_str(&k,":fr ^[0-9]+9 .*needle$\r");
+    for(int i=0;i<20;i++) bb_str(&k,"n");
+    doc=bench_doc(1000000,"needle",100000,&len);
+    bench_run("regex",doc,len,k.p,k.len);
+    free(k.p);
+    return 0;
+}
+
+int main(int argc, char *argv[]) { return bench_main(argc,argv); }
+#elif defined(ONEDITOR_TEST)
+// ------------- 自检 -------------
+// 构建：gcc -O2 -pthread -DONEDITOR_TEST oneditor.c -o oneditor_test
+// 对增量维护的结构做随机编辑，与从头重算的结果逐项比较；全部通过时退出码为0。
+
+unsigned test_seed = 1;
+// 可复现的伪随机数
+int test_rand() { test_seed=test_seed*1103515245+12345; return (int)((test_seed>>16)&0x7fff); }
+// 在随机位置插入片段或删除一段，或者撤销/重做
+void test_edit(const char **frags, int nfrag) {
+    size_t len=pt_length();
+    int op=test_rand()%4;
+    if(op<2) { const char *t=frags[test_rand()%nfrag]; buf_insert(len?(size_t)test_rand()*len/0x7fff:0,t,strlen(t)); }
+    else if(op==2&&len) { size_t o=(size_t)test_rand()*(len-1)/0x7fff, k=test_rand()%40; if(o+k>len) k=len-o; buf_delete(o,k); }
+    else { undo_close(); if(test_rand()%2) undo_restore(); else redo_restore(); }
+}
+// 高亮：编辑与只同步前若干行交替进行，已同步行的行末状态须与从头扫描一致
+int test_highlight() {
+    static const char *lines[]={"int x = 1; // c\n","/* start\n","  mid\n","end */ y=\"s\";\n","#include <a.h>\n","char *s=\"/* no */\";\n"};
+    static const char *frags[]={"/*","*/","x","\n","\n/*\n","*/\n","\"","//"};
+    int bad=0;
+    for(int round=0;round<20;round++) {
+        size_t cap=1<<16, n=0;
+        char *doc=(char*)malloc(cap);
+        for(int i=0;i<300;i++) { const char *l=lines[round%2?test_rand()%6:0]; size_t k=strlen(l); memcpy(doc+n,l,k); n+=k; }  // 单数轮混入多行注释
+        doc_replace(doc,n,0);
+        syntax_set(syntax_find("c"));
+        for(int it=0;it<300&&!bad;it++) {
+            test_edit(frags,8);
+            int r=test_rand()%4, upto=r==0?line_count:r==1?40:test_rand()%(line_count+1);  // 全文、首屏或任意位置
+            hl_sync(upto);
+            if(upto>line_count) upto=line_count;
+            if(hl_dirty<upto) { printf("高亮：同步到 %d 行后 hl_dirty=%d\n",upto,hl_dirty); bad++; }
+            unsigned char st=HS_NONE;
+            for(int i=0;i<upto&&!bad;i++) {
+                const char *s=line_get(i);
+                st=hl_lex(syntax,s,(int)strlen(s),st,NULL);
+                if(hl_state[i]!=st) { printf("高亮：第 %d 轮第 %d 次编辑后第 %d 行状态 %d，应为 %d\n",round,it,i,hl_state[i],st); bad++; }
+            }
+        }
+    }
+    syntax_set(NULL);
+    return bad;
+}
+#ifndef _WIN32
+#include <regex.h>
+// 比较 lines[0..count) 与 POSIX regexec 在[first,last)行上的结果
+int test_regex_lines(regex_t *rx, const char *pat, const char *what, const int *lines, int count, int first, int last) {
+    int k=0;
+    for(int l=first;l<last;l++) {
+        int want=regexec(rx,line_get(l),0,NULL,0)==0, got=k<count&&lines[k]==l;
+        if(got) k++;
+        if(want!=got) { printf("正则 %s（%s）：第 %d 行应%s匹配\n",pat,what,l,want?"":"不"); return 1; }
+    }
+    if(k!=count) { printf("正则 %s（%s）：索引有 %d 项多余或越界\n",pat,what,count-k); return 1; }
+    return 0;
+}
+// 正则：建立索引、编辑后增量维护、按任意行区间扫描，结果须与 POSIX regexec 逐行一致（含可空模式）；
+// view 为真时按只读查看运行，文档混入 \r\n 与单独的 \r
+int test_regex(int view) {
+    static const char *pats[]={"ab","a.b","^ab","b$","^$","a|xy","(ab)+c","a[bx]*y","[^a ]b","x{2}","a{1,3}b",
+        "^(a|b)*$","ab?a","(a|)b","x.*y$","a?","x*",".?","[^a]*","^",".*$"};
+    static const char *frags[]={"aBx\nab","ab\nxyb","\n","a","\n\n","xy","\r","\r\n"};
+    int npat=sizeof(pats)/sizeof(pats[0]), bad=0;
+    view_mode=view;
+    for(int it=0;it<100&&!bad;it++) {
+        size_t n=test_rand()%2000;
+        char *doc=(char*)malloc(n+1);
+        for(size_t i=0;i<n;i++) doc[i]=test_rand()%12==0?'\n':"abcAB xyXY-\r"[test_rand()%(view?12:11)];
+        doc_replace(doc,n,0);
+        for(int q=0;q<npat&&!bad;q++) {
+            regex_t rx; const char *err;
+            if(regcomp(&rx,pats[q],REG_EXTENDED|REG_ICASE|REG_NOSUB)) continue;
+            if(!match_index_build(pats[q],1,&err)) { printf("正则 %s 编译失败：%s\n",pats[q],err); regfree(&rx); return 1; }
+            bad+=test_regex_lines(&rx,pats[q],"建立",match_lines,match_count,0,line_count);
+            for(int e=0;e<8&&!bad;e++) {
+                test_edit(frags,view?8:6);
+                bad+=test_regex_lines(&rx,pats[q],"编辑后",match_lines,match_count,0,line_count);
+            }
+            // 分块建立索引时每块只能报告块内的行
+            int a=test_rand()%line_count, b=a+1+test_rand()%(line_count-a);
+            int *lines=NULL, count=0, cap=0;
+            Dfa d; dfa_init(&d,&match_re);
+            match_scan(&match_re,&d,line_off(a),b<line_count?line_off(b):pt_length()+1,&lines,&count,&cap);
+            dfa_free(&d);
+            if(!bad) bad+=test_regex_lines(&rx,pats[q],"区间",lines,count,a,b);
+            free(lines); regfree(&rx);
         }
     }
+    view_mode=0;
+    return bad;
 }
+#endif
 
+int main() {
+    int bad=0;
+    bad+=test_highlight();
+#ifndef _WIN32
+    bad+=test_regex(0);
+    bad+=test_regex(1);
+#endif
+    printf(bad?"自检失败\n":"自检通过\n");
+    return bad!=0;
+}
+#else
 // 主程序入口
 int main(int argc, char *argv[]) {
-    set_console_utf8(); set_console_raw();
-    if(argc>1) { strncpy(filename,argv[1],255); file_load(filename); } else { strcpy(lines[0],""); filename[0]=0; }
+    term_init(); atexit(term_shutdown); atexit(swap_exit); atexit(save_exit);
+    const char *fname=NULL;
+    for(int i=1;i<argc;i++) { if(strcmp(argv[i],"-r")==0) opt_recover=1; else if(strcmp(argv[i],"-R")==0) view_mode=1; else fname=argv[i]; }
+    if(view_mode) opt_recover=0;
+    if(fname) {
+        strncpy(filename,fname,255); filename[255]=0;
+        file_load(filename);
+        if(!swap_fp&&!opt_recover&&!view_mode&&!swap_exists(filename)) swap_open(filename);  // 新文件
+        if(opt_recover) {
+            long n=swap_recover(filename);
+            char msg[512];
+            if(n<0&&!swap_exists(filename)) swap_open(filename);
+            if(n<0) snprintf(msg,sizeof(msg),"没有可用的交换文件 %s.swp（不存在或与文件不符），按任意键继续\n",filename);
+            else snprintf(msg,sizeof(msg),"已从交换文件恢复 %ld 处编辑，按任意键继续\n",n);
+            print_utf8(msg); term_getkey();
+        }
+    } else filename[0]=0;
     adjust_scroll(count_lines(normal_help)+2); draw();
     while(1) {
-        int key=0;
-        if(insert_mode) {
-            key=_getwch();
-            insert_dispatch(key);
-            adjust_hscroll(MAX_COLS_SCREEN);
-            adjust_scroll(count_lines(insert_help)+2); draw();
-            continue;
-        }
-        key=_getch();
-        if(key==0||key==224) {
-            int arrow=_getwch();
-            if(arrow==75) norm_left(key);
-            else if(arrow==77) norm_right(key);
-            else if(arrow==72) norm_up(key);
-            else if(arrow==80) norm_down(key);
-        } else {
-            norm_dispatch(key);
-        }
-        adjust_hscroll(MAX_COLS_SCREEN);
-        adjust_scroll(count_lines(normal_help)+2); draw();
+        int ms=wait_timeout();
+        if(term.key_pending(ms)) {
+            unsigned long long t=now_ns();
+            int key=term_getkey();
+            perf_mark(PERF_READ,t); process_input(key);
+        } else if(load_poll()|save_finish(0)|autosave_tick()|follow_poll()) draw();
     }
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+# 生成 wcwidth_table.h：由 Python 自带的 Unicode 数据（unicodedata）构建两级码点属性表
+# 用法：python3 tools/gen_wcwidth.py > wcwidth_table.h
+#
+# 每个码点 4 位：低 2 位为显示宽度（0/1/2），第 2 位表示该码点并入前一个字形簇
+# （组合符号、变体选择符、ZWJ、肤色修饰符、韩文中/终声字母等）。
+# 第一级按 BLOCK 个码点分块，存放去重后的第二级块号；第二级每块 BLOCK/2 字节。
+import sys, unicodedata
+
+BLOCK = 128
+MAXCP = 0x110000
+EXTEND = 4
+
+def width(cp):
+    if cp == 0: return 0
+    cat = unicodedata.category(chr(cp))
+    if cat == 'Cc': return 1                     # 控制字符由编辑器显示为占位符
+    if cat in ('Mn', 'Me'): return 0
+    if cat == 'Cf' and cp != 0x00AD: return 0    # 软连字符仍占一列
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF: return 0
+    if cp == 0x200B: return 0
+    if unicodedata.east_asian_width(chr(cp)) in ('W', 'F'): return 2
+    # 未分配但保留给表意文字的平面按宽字符处理
+    if 0x3400 <= cp <= 0x4DBF or 0x4E00 <= cp <= 0x9FFF or 0xF900 <= cp <= 0xFAFF: return 2
+    if 0x20000 <= cp <= 0x2FFFD or 0x30000 <= cp <= 0x3FFFD: return 2
+    return 1
+
+def extend(cp):
+    cat = unicodedata.category(chr(cp))
+    if cat in ('Mn', 'Me', 'Mc'): return True
+    if cp in (0x200C, 0x200D): return True
+    if 0xFE00 <= cp <= 0xFE0F or 0xE0100 <= cp <= 0xE01EF: return True
+    if 0x1F3FB <= cp <= 0x1F3FF: return True    # 肤色修饰符
+    if 0xE0020 <= cp <= 0xE007F: return True    # 标签字符
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF: return True
+    return False
+
+def main():
+    props = [width(cp) | (EXTEND if extend(cp) else 0) for cp in range(MAXCP)]
+    blocks, index, stage1 = [], {}, []
+    for b in range(0, MAXCP, BLOCK):
+        packed = bytes(props[i] | props[i + 1] << 4 for i in range(b, b + BLOCK, 2))
+        if packed not in index:
+            index[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(index[packed])
+    assert len(blocks) < 65536
+    t1 = 'unsigned char' if len(blocks) < 256 else 'unsigned short'
+    w = sys.stdout.write
+    w('// 由 tools/gen_wcwidth.py 生成，勿手工修改（Unicode %s）\n' % unicodedata.unidata_version)
+    w('#define WCW_BLOCK %d\n' % BLOCK)
+    w('#define WCW_EXTEND %d\n' % EXTEND)
+    w('static const %s wcw_stage1[%d]={\n' % (t1, len(stage1)))
+    for i in range(0, len(stage1), 24):
+        w(''.join('%d,' % v for v in stage1[i:i + 24]) + '\n')
+    w('};\n')
+    w('static const unsigned char wcw_stage2[%d][%d]={\n' % (len(blocks), BLOCK // 2))
+    for blk in blocks:
+        w('{' + ','.join('0x%02x' % v for v in blk) + '},\n')
+    w('};\n')
+
+if __name__ == '__main__':
+    main()